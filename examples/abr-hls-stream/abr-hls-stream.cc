@@ -0,0 +1,67 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "framer.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <thread>
+
+// Streams an adaptive bitrate HLS ladder: every frame is converted once and scaled to three renditions, which are
+// encoded in parallel. Open abr/live.m3u8 in a player that supports HLS.
+
+int main() {
+  bool is_smoke_test = std::getenv("SMOKE_TEST") != nullptr;
+  const int fps = 30;
+  const int video_seconds = is_smoke_test ? 3 : 60;
+  const int width = 1280;
+  const int height = 720;
+
+  // the segments come and go while streaming, so they're kept together in a directory
+  std::filesystem::create_directories("abr");
+  std::vector<framer::rendition> ladder = {{1280, 720, 3000000}, {854, 480, 1500000}, {640, 360, 800000}};
+  abr_streamer abr("abr/live.m3u8", fps, width, height, ladder);
+
+  // HLS timestamps follow the wall clock, so frames are added in real time
+  std::vector<unsigned int> pixels(width * height);
+  auto stream_start = std::chrono::steady_clock::now();
+  for (int i = 0; i < fps * video_seconds; i++) {
+    std::this_thread::sleep_until(stream_start + std::chrono::microseconds(int64_t(i) * 1000000 / fps));
+    float seconds = float(i) / fps;
+    for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) {
+        float wave = sin(x * 0.01f + y * 0.02f + seconds * 2) * 0.5f + 0.5f;
+        unsigned char val = static_cast<unsigned char>(255 * wave);
+        pixels[y * width + x] = 0xFF000000 | (val << 16) | ((255 - val) << 8) | val;
+      }
+    }
+    abr.add_frame(pixels);
+  }
+
+  abr.finalize();
+
+  const char *playlists[] = {
+      "abr/live.m3u8", "abr/live_1280x720.m3u8", "abr/live_854x480.m3u8", "abr/live_640x360.m3u8"};
+  for (const char *playlist : playlists) {
+    if (!std::filesystem::exists(playlist)) {
+      fprintf(stderr, "missing %s\n", playlist);
+      return 1;
+    }
+  }
+  return 0;
+}
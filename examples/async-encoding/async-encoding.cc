@@ -0,0 +1,78 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "framer.hpp"
+
+#include <atomic>
+#include <cstdlib>
+
+// Encodes on background threads with set_async(). Packed frames are rendered straight into pool buffers, planar
+// frames are handed over without a copy and given back through their release callback.
+
+int main() {
+  const bool is_smoke_test = std::getenv("SMOKE_TEST") != nullptr;
+  const int fps = 30;
+  const int width = 640;
+  const int height = 480;
+  const int video_seconds = is_smoke_test ? 2 : 10;
+  const int num_frames = fps * video_seconds;
+
+  frame_streamer fs("async-encoding.mp4", 4000000, fps, width, height, frame_streamer::stream_mode::FILE);
+  fs.set_async(8, framer::backpressure::BLOCK);
+
+  fs.set_audio_callback([](float seconds, int fps, int num_channels, int16_t *channels) {
+    int v = 5000 * (fmod(seconds * 440 * 2, 2) < 1 ? 1 : -1);  // square wave
+    for (int i = 0; i < num_channels; i++) {
+      *channels++ = static_cast<int16_t>(v);
+    }
+  });
+
+  // packed frames, rendered into buffers from the pool
+  for (int i = 0; i < num_frames; i++) {
+    framer::frame_buffer *frame = fs.acquire_frame();
+    for (int y = 0; y < height; y++) {
+      uint32_t *row = frame->row(y);
+      for (int x = 0; x < width; x++) {
+        row[x] = 0xFF000000 | ((x + i) & 0xFF) << 16 | ((y + i) & 0xFF) << 8;
+      }
+    }
+    fs.submit_frame(frame);
+  }
+
+  // planar frames, each buffer stays with the encoder until its release callback runs
+  std::atomic<int> released{0};
+  std::vector<std::vector<uint8_t>> buffers(num_frames);
+  for (int i = 0; i < num_frames; i++) {
+    std::vector<uint8_t> &buffer = buffers[i];
+    buffer.resize(width * height * 3 / 2);
+    std::fill(buffer.begin(), buffer.begin() + width * height, static_cast<uint8_t>(16 + i % 200));
+    std::fill(buffer.begin() + width * height, buffer.end(), 128);
+
+    framer::yuv_planes planes;
+    planes.data[0] = buffer.data();
+    planes.data[1] = planes.data[0] + width * height;
+    planes.data[2] = planes.data[1] + width * height / 4;
+    planes.linesize[0] = width;
+    planes.linesize[1] = planes.linesize[2] = width / 2;
+    fs.add_frame(planes, [&released] { released++; });
+  }
+
+  fs.finalize();
+
+  printf("%zu frames dropped, %d of %d planar frames released\n", fs.dropped_frames(), released.load(), num_frames);
+  return released == num_frames ? 0 : 1;
+}
@@ -26,18 +26,19 @@ int main() {
   frame_streamer fs("hello_world.wav", 100000000, fps, width, height, frame_streamer::stream_mode::FILE);
 
   // Simple 440 Hz tone
-  fs.set_audio_callback([&fs](float seconds, int fps, int num_channels, int16_t *channels) {
+  fs.set_audio_callback([](float seconds, int fps, int num_channels, int16_t *channels) {
     int v = 5000 * (fmod(seconds * 440 * 2, 2) < 1 ? 1 : -1);  // square wave
     for (int i = 0; i < num_channels; i++) {
       *channels++ = static_cast<int16_t>(v);
     }
-    if (seconds >= 2.0) {
-      fs.stop();
-    }
   });
 
-  fs.record();
+  // two seconds, as fast as possible, record_mode::PACED would take two seconds of wall time
+  auto stats = fs.record(framer::record_mode::BATCH, 2.0);
   fs.finalize();
 
+  printf("%.2f s of audio in %.3f s, %.2f ms CPU per second of audio\n", stats.audio_seconds, stats.wall_seconds,
+         stats.cpu_per_audio_second() * 1000);
+
   return 0;
 }
@@ -0,0 +1,51 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "framer.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+
+// Renders a clip offline with chunked_encoder: one-second chunks of the timeline are encoded on independent encoders
+// in parallel, then joined into one file.
+
+int main() {
+  bool is_smoke_test = std::getenv("SMOKE_TEST") != nullptr;
+  const int fps = 30;
+  const int video_seconds = is_smoke_test ? 4 : 60;
+  const int width = 1280;
+  const int height = 720;
+
+  chunked_encoder enc("chunked-encoding.mp4", 4000000, fps, width, height);
+  enc.set_chunk_frames(fps);
+  enc.set_parallel_chunks(2);
+
+  // called from several threads at once, so it only depends on the frame index
+  enc.encode(fps * video_seconds, [fps](int64_t frame, std::vector<unsigned int> &pixels, int width, int height) {
+    float seconds = float(frame) / fps;
+    for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) {
+        float wave = sin(x * 0.02f - y * 0.01f + seconds * 3) * 0.5f + 0.5f;
+        unsigned char val = static_cast<unsigned char>(255 * wave);
+        pixels[y * width + x] = 0xFF000000 | (val << 16) | (val << 8) | (255 - val);
+      }
+    }
+  });
+
+  return std::filesystem::exists("chunked-encoding.mp4") ? 0 : 1;
+}
@@ -0,0 +1,73 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "framer.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+
+// 5.1 audio at 48 kHz from a float callback, encoded on its own thread. The callback fills interleaved samples, the
+// encoder takes them planar, so they are only deinterleaved on the way, or remapped if the encoder orders the
+// channels differently.
+
+int main() {
+  const bool is_smoke_test = std::getenv("SMOKE_TEST") != nullptr;
+  const int fps = 30;
+  const int width = 640;
+  const int height = 480;
+  const int video_seconds = is_smoke_test ? 2 : 10;
+
+  framer::audio_options audio;
+  audio.sample_rate = 48000;
+  audio.channels = 6;
+  audio.bitrate = 256000;
+  frame_streamer fs("surround-audio.mp4",
+                    2000000,
+                    fps,
+                    width,
+                    height,
+                    frame_streamer::stream_mode::FILE,
+                    framer::color_mode::BGRA,
+                    framer::color_space::AUTO,
+                    framer::color_range::LIMITED,
+                    audio);
+  fs.set_audio_thread();
+
+  // a tone that moves from speaker to speaker, one per second, the LFE channel stays silent
+  fs.set_audio_float_callback(
+      [](double start_seconds, int sample_rate, int num_channels, int nb_samples, float *const *channels) {
+        float *samples = channels[0];
+        for (int j = 0; j < nb_samples; j++) {
+          const double seconds = start_seconds + double(j) / sample_rate;
+          const float v = 0.25f * static_cast<float>(std::sin(2 * M_PI * 440 * seconds));
+          const int speaker = static_cast<int>(seconds) % num_channels;
+          for (int i = 0; i < num_channels; i++) *samples++ = i == speaker && i != 3 ? v : 0.0f;
+        }
+      },
+      framer::sample_layout::INTERLEAVED);
+
+  std::vector<unsigned int> pixels(width * height);
+  for (int i = 0; i < fps * video_seconds; i++) {
+    const unsigned int shade = (i * 255 / (fps * video_seconds)) & 0xFF;
+    std::fill(pixels.begin(), pixels.end(), 0xFF000000 | shade << 8 | (255 - shade));
+    fs.add_frame(pixels);
+  }
+
+  fs.finalize();
+  return std::filesystem::exists("surround-audio.mp4") ? 0 : 1;
+}
@@ -0,0 +1,68 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "framer.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+
+// Encodes a file in two passes: the frames go through a fast analysis pass and are spooled, finalize() encodes them
+// again with the statistics it collected. Renders once, encodes twice.
+
+int main() {
+  bool is_smoke_test = std::getenv("SMOKE_TEST") != nullptr;
+  const int fps = 30;
+  const int video_seconds = is_smoke_test ? 3 : 30;
+  const int width = 640;
+  const int height = 480;
+
+  frame_streamer fs("two-pass-encoding.mp4", 1000000, fps, width, height, frame_streamer::stream_mode::FILE);
+  fs.set_two_pass([](int pass, int64_t done, int64_t total) {
+    if (done == total || done % 30 == 0) {
+      printf("pass %d: %lld/%lld frames\n", pass, (long long)done, (long long)total);
+    }
+  });
+
+  fs.set_audio_callback([](float seconds, int fps, int num_channels, int16_t *channels) {
+    int v = 5000 * (fmod(seconds * 440 * 2, 2) < 1 ? 1 : -1);  // square wave
+    for (int i = 0; i < num_channels; i++) {
+      *channels++ = static_cast<int16_t>(v);
+    }
+  });
+
+  std::vector<unsigned int> pixels(width * height);
+  for (int i = 0; i < fps * video_seconds; i++) {
+    for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) {
+        // noise in a moving box is hard to compress, the second pass gives it more of the bitrate
+        bool box = std::abs(x - (i * 4) % width) < 80 && std::abs(y - height / 2) < 80;
+        unsigned char val = box ? static_cast<unsigned char>((x * 7919 + y * 104729 + i * 31) >> 3) : 64;
+        pixels[y * width + x] = 0xFF000000 | (val << 16) | (val << 8) | val;
+      }
+    }
+    fs.add_frame(pixels);
+  }
+
+  fs.finalize();
+
+  // the spool and the statistics are gone, only the output is left
+  if (std::filesystem::exists("two-pass-encoding.mp4.spool") || !std::filesystem::exists("two-pass-encoding.mp4")) {
+    return 1;
+  }
+  return 0;
+}
@@ -23,7 +23,7 @@
 #include <thread>
 
 float smooth_envelope(float t, float attack, float release, float total_duration);
-std::vector<unsigned int> cool_gradient_spiral_animation(float time, int width, int height);
+void cool_gradient_spiral_animation(float time, framer::frame_buffer *frame);
 
 int main() {
   bool is_smoke_test = std::getenv("SMOKE_TEST") != nullptr;
@@ -64,8 +64,9 @@ int main() {
   // This may not be what you want!
   /*
   for (int i = 0; i < fps * video_seconds; i++) {
-      auto pixelVector = cool_gradient_spiral_animation(i * 0.1f, width, height);
-      fs.add_frame(pixelVector);
+      auto frame = fs.acquire_frame();
+      cool_gradient_spiral_animation(i * 0.1f, frame);
+      fs.submit_frame(frame);
   }
   */
 
@@ -89,8 +90,10 @@ int main() {
       // We're running too fast - sleep until target time
       std::this_thread::sleep_for(std::chrono::duration<double>(target_time - elapsed));
     }
-    auto pixelVector = cool_gradient_spiral_animation(i * 0.1f, width, height);
-    fs.add_frame(pixelVector);
+    // Render into a buffer owned by framer, this way no memory is allocated per frame
+    auto frame = fs.acquire_frame();
+    cool_gradient_spiral_animation(i * 0.1f, frame);
+    fs.submit_frame(frame);
   }
 
   fs.finalize();
@@ -116,12 +119,13 @@ float smooth_envelope(float t, float attack, float release, float total_duration
   return 1.0f;
 }
 
-std::vector<unsigned int> cool_gradient_spiral_animation(float time, int width, int height) {
-  std::vector<unsigned int> pixelVector;
-  pixelVector.reserve(width * height);
+void cool_gradient_spiral_animation(float time, framer::frame_buffer *frame) {
+  const int width = frame->width();
+  const int height = frame->height();
 
   // Create a moving gradient pattern
   for (int y = 0; y < height; y++) {
+    unsigned int *row = frame->row(y);
     for (int x = 0; x < width; x++) {
       float cx = x - width / 2;
       float cy = y - height / 2;
@@ -141,8 +145,7 @@ std::vector<unsigned int> cool_gradient_spiral_animation(float time, int width,
       unsigned char b = static_cast<unsigned char>(255 * circle2);
 
       unsigned int pixel = (r << 24) | (g << 16) | (b << 8) | 0xFF;
-      pixelVector.push_back(pixel);
+      row[x] = pixel;
     }
   }
-  return pixelVector;
 }
\ No newline at end of file
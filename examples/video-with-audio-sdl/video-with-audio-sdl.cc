@@ -25,6 +25,9 @@ struct AudioData {
   Uint8* start;
   Uint32 length;
   bool loop;
+  SDL_AudioSpec spec;
+  frame_streamer* fs;
+  std::vector<int16_t> converted;
 };
 
 void audioCallback(void* userdata, Uint8* stream, int len) {
@@ -41,6 +44,17 @@ void audioCallback(void* userdata, Uint8* stream, int len) {
     memcpy(stream, audio->pos, len);
     audio->pos += len;
   }
+
+  // Record exactly what is being played, pushing doesn't wait for the encoder
+  const int channels = audio->spec.channels;
+  if (audio->spec.format == AUDIO_S16) {
+    audio->fs->add_audio_samples(stream, len / 2 / channels, framer::sample_format::S16, audio->spec.freq, channels);
+  } else if (audio->spec.format == AUDIO_U8) {
+    audio->converted.resize(len);
+    for (int i = 0; i < len; i++) audio->converted[i] = (stream[i] - 128) * 256;
+    audio->fs->add_audio_samples(
+        audio->converted.data(), len / channels, framer::sample_format::S16, audio->spec.freq, channels);
+  }
 }
 
 int main() {
@@ -66,8 +80,13 @@ int main() {
     return 1;
   }
 
+  // Initialize video encoder, the audio SDL plays is pushed into it from SDL's audio thread
+  frame_streamer fs("sdl_capture.mp4", 100000000, fps, width, height, frame_streamer::stream_mode::FILE);
+  fs.enable_audio_samples();
+
   // Setup audio data
-  AudioData audio = {.pos = wav_buffer, .start = wav_buffer, .length = wav_length, .loop = true};
+  AudioData audio = {
+      .pos = wav_buffer, .start = wav_buffer, .length = wav_length, .loop = true, .spec = wav_spec, .fs = &fs};
 
   // Setup SDL audio
   wav_spec.callback = audioCallback;
@@ -75,32 +94,6 @@ int main() {
   SDL_AudioDeviceID audioDevice = SDL_OpenAudioDevice(nullptr, 0, &wav_spec, nullptr, 0);
   SDL_PauseAudioDevice(audioDevice, 0);
 
-  // Initialize video encoder
-  frame_streamer fs("sdl_capture.mp4", 100000000, fps, width, height, frame_streamer::stream_mode::FILE);
-
-  // Set up audio callback for the video file
-  // This will read from our WAV buffer directly
-  fs.set_audio_callback(
-      [wav_buffer, wav_length, wav_spec](float seconds, int fps, int num_channels, int16_t* channels) {
-        // Calculate position in WAV buffer based on time
-        Uint32 pos =
-            static_cast<Uint32>(seconds * wav_spec.freq) * wav_spec.channels * (SDL_AUDIO_BITSIZE(wav_spec.format) / 8);
-        pos %= wav_length;  // Loop the sample
-
-        // Copy audio data for all channels
-        for (int i = 0; i < num_channels; i++) {
-          // Handle different WAV formats
-          if (wav_spec.format == AUDIO_S16) {
-            channels[i] = ((int16_t*)wav_buffer)[pos / 2];
-          } else if (wav_spec.format == AUDIO_U8) {
-            channels[i] = (wav_buffer[pos] - 128) * 256;
-          }
-        }
-      });
-
-  // Vector for pixel data
-  std::vector<unsigned int> pixels(width * height);
-
   // Main loop
   for (int frame = 0; frame < fps * video_seconds; frame++) {
     float time = frame / static_cast<float>(fps);
@@ -127,19 +120,18 @@ int main() {
     // Capture frame
     SDL_Surface* surface = SDL_CreateRGBSurface(0, width, height, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
     SDL_RenderReadPixels(renderer, nullptr, SDL_PIXELFORMAT_ARGB8888, surface->pixels, surface->pitch);
-    memcpy(pixels.data(), surface->pixels, width * height * sizeof(unsigned int));
-    SDL_FreeSurface(surface);
 
-    // Add frame to video
-    fs.add_frame(pixels);
+    // Add frame to video, straight from the (possibly padded) surface, ARGB8888 is stored as BGRA in memory
+    fs.add_frame(framer::image_view(surface->pixels, width, height, surface->pitch, framer::color_mode::BGRA));
+    SDL_FreeSurface(surface);
 
     SDL_Delay(1000 / fps);
   }
 
-  // Cleanup
+  // Cleanup, the audio device goes first so that nothing is pushed into a finalized streamer
+  SDL_CloseAudioDevice(audioDevice);
   fs.finalize();
   SDL_FreeWAV(wav_buffer);
-  SDL_CloseAudioDevice(audioDevice);
   SDL_DestroyRenderer(renderer);
   SDL_DestroyWindow(window);
   SDL_Quit();
@@ -39,9 +39,18 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
 #include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <utility>
 
 template <typename F>
@@ -81,19 +90,23 @@ scope_guard<F> make_scope_guard(F &&f) {
  */
 
 #include <chrono>
+#include <deque>
 #include <vector>
 
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavcodec/codec.h>
 #include <libavformat/avformat.h>
 #include <libavutil/avassert.h>
+#include <libavutil/audio_fifo.h>
 #include <libavutil/channel_layout.h>
+#include <libavutil/imgutils.h>
 #include <libavutil/mathematics.h>
 #include <libavutil/opt.h>
 #include <libavutil/timestamp.h>
@@ -146,12 +159,1133 @@ static const std::string av_ts_make_time_string(int64_t ts, AVRational *tb) {
 #define av_ts2timestr(ts, tb) av_ts_make_time_string(ts, tb).c_str()
 #endif  // __cplusplus
 
-class frame_streamer;
-static frame_streamer *global_this = nullptr;
+// Packed 32-bit pixels -> YUV420P conversion kernels.
+//
+// All kernels use the same fixed-point formula, so the vectorized versions produce output that is bit-identical to the
+// scalar fallback: out = clamp((k0 * b0 + k1 * b1 + k2 * b2 + bias) >> fraction_bits), where b0..b2 are the first three
+// bytes of a pixel in memory. The scalar kernel reads the products from per-channel lookup tables, the vector kernels
+// multiply. The channel order (RGBA vs. BGRA) is folded into the coefficients, so none of the kernels have to swizzle
+// pixels. Chroma is taken from the top-left pixel of every 2x2 block.
+//
+// Define FRAMER_NO_SIMD to always use the scalar kernel.
+#if !defined(FRAMER_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FRAMER_SIMD_X86 1
+#include <immintrin.h>
+#elif !defined(FRAMER_NO_SIMD) && defined(__ARM_NEON)
+#define FRAMER_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace yuv {
+
+// Coefficients are scaled by 2^14, the largest (full range luma for green, 0.7152 * 2^14) still fits in an int16_t.
+constexpr int fraction_bits = 14;
+
+struct coefficients {
+  // indexed by byte position within the pixel, the fourth (alpha) byte always has a zero weight
+  int16_t y[4];
+  int16_t u[4];
+  int16_t v[4];
+  int32_t y_bias;
+  int32_t uv_bias;
+
+  // lut_y[i][b] == y[i] * b, the bias is folded into the first table
+  int32_t lut_y[3][256];
+  int32_t lut_u[3][256];
+  int32_t lut_v[3][256];
+};
+
+/**
+ * Builds the coefficients for the matrix given by its kr and kb luma weights (0.299/0.114 for BT.601, 0.2126/0.0722
+ * for BT.709, 0.2627/0.0593 for BT.2020). r/g/b are the byte positions of the channels within a pixel.
+ */
+inline coefficients make_coefficients(double kr, double kb, bool full_range, int r, int g, int b) {
+  const double one = 1 << fraction_bits;
+  const double y_scale = full_range ? 1.0 : 219.0 / 255.0;
+  const double c_scale = full_range ? 1.0 : 224.0 / 255.0;
+  const auto fixed = [&](double v) { return static_cast<int16_t>(std::lround(v * one)); };
+
+  coefficients k = {};
+  k.y[r] = fixed(kr * y_scale);
+  k.y[b] = fixed(kb * y_scale);
+  k.y[g] = static_cast<int16_t>(fixed(y_scale) - k.y[r] - k.y[b]);  // white maps exactly to the top of the range
+  k.u[r] = fixed(-0.5 * kr / (1.0 - kb) * c_scale);
+  k.u[b] = fixed(0.5 * c_scale);
+  k.u[g] = static_cast<int16_t>(-k.u[r] - k.u[b]);  // rows sum to zero, so grays have neutral chroma
+  k.v[r] = fixed(0.5 * c_scale);
+  k.v[b] = fixed(-0.5 * kb / (1.0 - kr) * c_scale);
+  k.v[g] = static_cast<int16_t>(-k.v[r] - k.v[b]);
+  const int32_t rounding = 1 << (fraction_bits - 1);
+  k.y_bias = ((full_range ? 0 : 16) << fraction_bits) + rounding;
+  k.uv_bias = (128 << fraction_bits) + rounding;
+
+  for (int i = 0; i < 3; i++) {
+    for (int v = 0; v < 256; v++) {
+      k.lut_y[i][v] = k.y[i] * v + (i == 0 ? k.y_bias : 0);
+      k.lut_u[i][v] = k.u[i] * v + (i == 0 ? k.uv_bias : 0);
+      k.lut_v[i][v] = k.v[i] * v + (i == 0 ? k.uv_bias : 0);
+    }
+  }
+  return k;
+}
+
+inline uint8_t clamp_u8(int32_t v) { return static_cast<uint8_t>(v < 0 ? 0 : (v > 255 ? 255 : v)); }
+
+// four 16-bit coefficients as one 64-bit value, for broadcasting into vector registers
+inline int64_t pack4(const int16_t *k) {
+  int64_t v;
+  memcpy(&v, k, sizeof(v));
+  return v;
+}
+
+/**
+ * Converts one row of width pixels. The chroma pointers are nullptr for odd rows, which only produce luma.
+ */
+using convert_row_fn = void (*)(
+    const uint32_t *src, int width, uint8_t *dst_y, uint8_t *dst_u, uint8_t *dst_v, const coefficients &k);
+
+inline void convert_row_scalar(
+    const uint32_t *src, int width, uint8_t *dst_y, uint8_t *dst_u, uint8_t *dst_v, const coefficients &k) {
+  for (int x = 0; x < width; x++) {
+    const uint32_t pixel = src[x];
+    const uint8_t b0 = (pixel >> 0) & 0xFF;
+    const uint8_t b1 = (pixel >> 8) & 0xFF;
+    const uint8_t b2 = (pixel >> 16) & 0xFF;
+    dst_y[x] = clamp_u8((k.lut_y[0][b0] + k.lut_y[1][b1] + k.lut_y[2][b2]) >> fraction_bits);
+    if (dst_u && (x % 2) == 0) {
+      dst_u[x / 2] = clamp_u8((k.lut_u[0][b0] + k.lut_u[1][b1] + k.lut_u[2][b2]) >> fraction_bits);
+      dst_v[x / 2] = clamp_u8((k.lut_v[0][b0] + k.lut_v[1][b1] + k.lut_v[2][b2]) >> fraction_bits);
+    }
+  }
+}
+
+#if defined(FRAMER_SIMD_X86)
+// SSE4.1: 8 pixels per iteration
+
+__attribute__((target("sse4.1"))) inline __m128i weigh4_sse41(__m128i px, __m128i k, __m128i bias) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(px, zero), k);  // pixel 0 and 1, two partial sums each
+  const __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(px, zero), k);  // pixel 2 and 3
+  return _mm_srai_epi32(_mm_add_epi32(_mm_hadd_epi32(lo, hi), bias), fraction_bits);
+}
+
+__attribute__((target("sse4.1"))) inline void convert_row_sse41(
+    const uint32_t *src, int width, uint8_t *dst_y, uint8_t *dst_u, uint8_t *dst_v, const coefficients &k) {
+  const __m128i ky = _mm_set1_epi64x(pack4(k.y));
+  const __m128i ku = _mm_set1_epi64x(pack4(k.u));
+  const __m128i kv = _mm_set1_epi64x(pack4(k.v));
+  const __m128i y_bias = _mm_set1_epi32(k.y_bias);
+  const __m128i uv_bias = _mm_set1_epi32(k.uv_bias);
+  int x = 0;
+  for (; x + 8 <= width; x += 8) {
+    const __m128i p0 = _mm_loadu_si128((const __m128i *)(src + x));
+    const __m128i p1 = _mm_loadu_si128((const __m128i *)(src + x + 4));
+    const __m128i y16 = _mm_packs_epi32(weigh4_sse41(p0, ky, y_bias), weigh4_sse41(p1, ky, y_bias));
+    _mm_storel_epi64((__m128i *)(dst_y + x), _mm_packus_epi16(y16, y16));
+    if (dst_u) {
+      // pixels 0, 2, 4 and 6
+      const __m128i even =
+          _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(p0), _mm_castsi128_ps(p1), _MM_SHUFFLE(2, 0, 2, 0)));
+      const __m128i uv16 = _mm_packs_epi32(weigh4_sse41(even, ku, uv_bias), weigh4_sse41(even, kv, uv_bias));
+      const __m128i uv8 = _mm_packus_epi16(uv16, uv16);
+      const int32_t u = _mm_cvtsi128_si32(uv8);
+      const int32_t v = _mm_extract_epi32(uv8, 1);
+      memcpy(dst_u + x / 2, &u, sizeof(u));
+      memcpy(dst_v + x / 2, &v, sizeof(v));
+    }
+  }
+  convert_row_scalar(
+      src + x, width - x, dst_y + x, dst_u ? dst_u + x / 2 : nullptr, dst_v ? dst_v + x / 2 : nullptr, k);
+}
+
+// AVX2: 16 pixels per iteration
+
+__attribute__((target("avx2"))) inline __m256i weigh8_avx2(__m256i px, __m256i k, __m256i bias) {
+  const __m256i zero = _mm256_setzero_si256();
+  // unpack/hadd operate within 128-bit lanes, which cancels out: the result holds pixels 0..7 in order
+  const __m256i lo = _mm256_madd_epi16(_mm256_unpacklo_epi8(px, zero), k);
+  const __m256i hi = _mm256_madd_epi16(_mm256_unpackhi_epi8(px, zero), k);
+  return _mm256_srai_epi32(_mm256_add_epi32(_mm256_hadd_epi32(lo, hi), bias), fraction_bits);
+}
+
+__attribute__((target("avx2"))) inline void convert_row_avx2(
+    const uint32_t *src, int width, uint8_t *dst_y, uint8_t *dst_u, uint8_t *dst_v, const coefficients &k) {
+  const __m256i ky = _mm256_set1_epi64x(pack4(k.y));
+  const __m256i ku = _mm256_set1_epi64x(pack4(k.u));
+  const __m256i kv = _mm256_set1_epi64x(pack4(k.v));
+  const __m256i y_bias = _mm256_set1_epi32(k.y_bias);
+  const __m256i uv_bias = _mm256_set1_epi32(k.uv_bias);
+  const __m256i uv_order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    const __m256i p0 = _mm256_loadu_si256((const __m256i *)(src + x));
+    const __m256i p1 = _mm256_loadu_si256((const __m256i *)(src + x + 8));
+    // packs interleaves the 128-bit lanes of both operands, permute restores pixel order
+    __m256i y16 = _mm256_packs_epi32(weigh8_avx2(p0, ky, y_bias), weigh8_avx2(p1, ky, y_bias));
+    y16 = _mm256_permute4x64_epi64(y16, _MM_SHUFFLE(3, 1, 2, 0));
+    const __m256i y8 = _mm256_permute4x64_epi64(_mm256_packus_epi16(y16, y16), _MM_SHUFFLE(3, 1, 2, 0));
+    _mm_storeu_si128((__m128i *)(dst_y + x), _mm256_castsi256_si128(y8));
+    if (dst_u) {
+      // pixels 0, 2, .., 14
+      __m256i even = _mm256_castps_si256(
+          _mm256_shuffle_ps(_mm256_castsi256_ps(p0), _mm256_castsi256_ps(p1), _MM_SHUFFLE(2, 0, 2, 0)));
+      even = _mm256_permute4x64_epi64(even, _MM_SHUFFLE(3, 1, 2, 0));
+      const __m256i uv16 = _mm256_packs_epi32(weigh8_avx2(even, ku, uv_bias), weigh8_avx2(even, kv, uv_bias));
+      const __m256i uv8 = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(uv16, uv16), uv_order);
+      const __m128i uv = _mm256_castsi256_si128(uv8);
+      _mm_storel_epi64((__m128i *)(dst_u + x / 2), uv);
+      _mm_storel_epi64((__m128i *)(dst_v + x / 2), _mm_srli_si128(uv, 8));
+    }
+  }
+  convert_row_scalar(
+      src + x, width - x, dst_y + x, dst_u ? dst_u + x / 2 : nullptr, dst_v ? dst_v + x / 2 : nullptr, k);
+}
+
+// AVX-512: 32 pixels per iteration
+
+__attribute__((target("avx512f,avx512bw"))) inline __m256i weigh8_avx512(__m256i px, __m512i k) {
+  const __m512i sums = _mm512_madd_epi16(_mm512_cvtepu8_epi16(px), k);  // two partial sums per pixel
+  return _mm512_cvtepi64_epi32(_mm512_add_epi32(sums, _mm512_srli_epi64(sums, 32)));
+}
+
+__attribute__((target("avx512f,avx512bw"))) inline __m128i weigh16_avx512(__m256i px0,
+                                                                          __m256i px1,
+                                                                          __m512i k,
+                                                                          __m512i bias) {
+  __m512i v = _mm512_inserti64x4(_mm512_castsi256_si512(weigh8_avx512(px0, k)), weigh8_avx512(px1, k), 1);
+  v = _mm512_max_epi32(_mm512_srai_epi32(_mm512_add_epi32(v, bias), fraction_bits), _mm512_setzero_si512());
+  return _mm512_cvtusepi32_epi8(v);
+}
+
+__attribute__((target("avx512f,avx512bw"))) inline void convert_row_avx512(
+    const uint32_t *src, int width, uint8_t *dst_y, uint8_t *dst_u, uint8_t *dst_v, const coefficients &k) {
+  const __m512i ky = _mm512_set1_epi64(pack4(k.y));
+  const __m512i ku = _mm512_set1_epi64(pack4(k.u));
+  const __m512i kv = _mm512_set1_epi64(pack4(k.v));
+  const __m512i y_bias = _mm512_set1_epi32(k.y_bias);
+  const __m512i uv_bias = _mm512_set1_epi32(k.uv_bias);
+  const __m512i even_index = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+  int x = 0;
+  for (; x + 32 <= width; x += 32) {
+    const __m256i p0 = _mm256_loadu_si256((const __m256i *)(src + x));
+    const __m256i p1 = _mm256_loadu_si256((const __m256i *)(src + x + 8));
+    const __m256i p2 = _mm256_loadu_si256((const __m256i *)(src + x + 16));
+    const __m256i p3 = _mm256_loadu_si256((const __m256i *)(src + x + 24));
+    _mm_storeu_si128((__m128i *)(dst_y + x), weigh16_avx512(p0, p1, ky, y_bias));
+    _mm_storeu_si128((__m128i *)(dst_y + x + 16), weigh16_avx512(p2, p3, ky, y_bias));
+    if (dst_u) {
+      // pixels 0, 2, .., 30
+      const __m512i lo = _mm512_inserti64x4(_mm512_castsi256_si512(p0), p1, 1);
+      const __m512i hi = _mm512_inserti64x4(_mm512_castsi256_si512(p2), p3, 1);
+      const __m512i even = _mm512_permutex2var_epi32(lo, even_index, hi);
+      const __m256i e0 = _mm512_castsi512_si256(even);
+      const __m256i e1 = _mm512_extracti64x4_epi64(even, 1);
+      _mm_storeu_si128((__m128i *)(dst_u + x / 2), weigh16_avx512(e0, e1, ku, uv_bias));
+      _mm_storeu_si128((__m128i *)(dst_v + x / 2), weigh16_avx512(e0, e1, kv, uv_bias));
+    }
+  }
+  convert_row_scalar(
+      src + x, width - x, dst_y + x, dst_u ? dst_u + x / 2 : nullptr, dst_v ? dst_v + x / 2 : nullptr, k);
+}
+#endif  // FRAMER_SIMD_X86
+
+#if defined(FRAMER_SIMD_NEON)
+// NEON: 16 pixels per iteration
+
+inline uint8x8_t weigh8_neon(uint8x8_t b0, uint8x8_t b1, uint8x8_t b2, const int16_t *k, int32_t bias) {
+  const int16x8_t c0 = vreinterpretq_s16_u16(vmovl_u8(b0));
+  const int16x8_t c1 = vreinterpretq_s16_u16(vmovl_u8(b1));
+  const int16x8_t c2 = vreinterpretq_s16_u16(vmovl_u8(b2));
+  int32x4_t lo = vdupq_n_s32(bias);
+  int32x4_t hi = vdupq_n_s32(bias);
+  lo = vmlal_n_s16(lo, vget_low_s16(c0), k[0]);
+  hi = vmlal_n_s16(hi, vget_high_s16(c0), k[0]);
+  lo = vmlal_n_s16(lo, vget_low_s16(c1), k[1]);
+  hi = vmlal_n_s16(hi, vget_high_s16(c1), k[1]);
+  lo = vmlal_n_s16(lo, vget_low_s16(c2), k[2]);
+  hi = vmlal_n_s16(hi, vget_high_s16(c2), k[2]);
+  const uint16x8_t v =
+      vcombine_u16(vqmovun_s32(vshrq_n_s32(lo, fraction_bits)), vqmovun_s32(vshrq_n_s32(hi, fraction_bits)));
+  return vqmovn_u16(v);
+}
+
+inline void convert_row_neon(
+    const uint32_t *src, int width, uint8_t *dst_y, uint8_t *dst_u, uint8_t *dst_v, const coefficients &k) {
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    const uint8x16x4_t px = vld4q_u8((const uint8_t *)(src + x));  // deinterleaved by byte position
+    const uint8x8_t y_lo =
+        weigh8_neon(vget_low_u8(px.val[0]), vget_low_u8(px.val[1]), vget_low_u8(px.val[2]), k.y, k.y_bias);
+    const uint8x8_t y_hi =
+        weigh8_neon(vget_high_u8(px.val[0]), vget_high_u8(px.val[1]), vget_high_u8(px.val[2]), k.y, k.y_bias);
+    vst1q_u8(dst_y + x, vcombine_u8(y_lo, y_hi));
+    if (dst_u) {
+      // pixels 0, 2, .., 14
+      const uint8x8_t e0 = vget_low_u8(vuzpq_u8(px.val[0], px.val[0]).val[0]);
+      const uint8x8_t e1 = vget_low_u8(vuzpq_u8(px.val[1], px.val[1]).val[0]);
+      const uint8x8_t e2 = vget_low_u8(vuzpq_u8(px.val[2], px.val[2]).val[0]);
+      vst1_u8(dst_u + x / 2, weigh8_neon(e0, e1, e2, k.u, k.uv_bias));
+      vst1_u8(dst_v + x / 2, weigh8_neon(e0, e1, e2, k.v, k.uv_bias));
+    }
+  }
+  convert_row_scalar(
+      src + x, width - x, dst_y + x, dst_u ? dst_u + x / 2 : nullptr, dst_v ? dst_v + x / 2 : nullptr, k);
+}
+#endif  // FRAMER_SIMD_NEON
+
+/**
+ * Picks the widest kernel the CPU supports, the choice is made once per process.
+ */
+inline convert_row_fn select_convert_row() {
+#if defined(FRAMER_SIMD_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) return convert_row_avx512;
+  if (__builtin_cpu_supports("avx2")) return convert_row_avx2;
+  if (__builtin_cpu_supports("sse4.1")) return convert_row_sse41;
+#elif defined(FRAMER_SIMD_NEON)
+  return convert_row_neon;
+#endif
+  return convert_row_scalar;
+}
+
+inline convert_row_fn convert_row() {
+  static const convert_row_fn fn = select_convert_row();
+  return fn;
+}
+
+}  // namespace yuv
+
+// Float sample helpers for the audio path.
+namespace pcm {
+
+// Interleaved -> planar float, for encoders that take FLTP (AAC, Opus). Stereo is vectorized.
+inline void deinterleave(const float *src, float *const *dst, int num_channels, int nb_samples) {
+  if (num_channels == 2) {
+    float *left = dst[0], *right = dst[1];
+    int j = 0;
+#if defined(FRAMER_SIMD_X86) && defined(__SSE2__)
+    for (; j + 4 <= nb_samples; j += 4) {
+      const __m128 a = _mm_loadu_ps(src + 2 * j);      // l0 r0 l1 r1
+      const __m128 b = _mm_loadu_ps(src + 2 * j + 4);  // l2 r2 l3 r3
+      _mm_storeu_ps(left + j, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+      _mm_storeu_ps(right + j, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+#elif defined(FRAMER_SIMD_NEON)
+    for (; j + 4 <= nb_samples; j += 4) {
+      const float32x4x2_t lr = vld2q_f32(src + 2 * j);
+      vst1q_f32(left + j, lr.val[0]);
+      vst1q_f32(right + j, lr.val[1]);
+    }
+#endif
+    for (; j < nb_samples; j++) {
+      left[j] = src[2 * j];
+      right[j] = src[2 * j + 1];
+    }
+    return;
+  }
+  for (int ch = 0; ch < num_channels; ch++) {
+    float *out = dst[ch];
+    for (int j = 0; j < nb_samples; j++) out[j] = src[size_t(j) * num_channels + ch];
+  }
+}
+
+}  // namespace pcm
+
+/**
+ * Small fixed-size thread pool that runs a function over an index range, used to convert frames in row bands.
+ * The thread calling parallel_for() participates, so a pool of size N runs N - 1 worker threads.
+ */
+class worker_pool {
+  std::vector<std::thread> threads_;
+  std::mutex mut_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  const std::function<void(int)> *job_ = nullptr;
+  int job_size_ = 0;
+  std::atomic<int> next_{0};
+  size_t busy_ = 0;
+  uint64_t generation_ = 0;
+  bool stopping_ = false;
+
+  void run(const std::function<void(int)> &job, int n) {
+    for (int i = next_.fetch_add(1); i < n; i = next_.fetch_add(1)) {
+      job(i);
+    }
+  }
+
+  // seen is the generation when the worker was spawned, jobs before it are done and the next one may already be posted
+  void worker(uint64_t seen) {
+    std::unique_lock<std::mutex> lock(mut_);
+    while (true) {
+      work_cv_.wait(lock, [&] { return stopping_ || generation_ != seen; });
+      if (stopping_) return;
+      seen = generation_;
+      const std::function<void(int)> *job = job_;
+      const int n = job_size_;
+      lock.unlock();
+      run(*job, n);
+      lock.lock();
+      if (--busy_ == 0) done_cv_.notify_one();
+    }
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mut_);
+      stopping_ = true;
+    }
+    work_cv_.notify_all();
+    for (auto &t : threads_) t.join();
+    threads_.clear();
+    stopping_ = false;
+  }
+
+public:
+  worker_pool() = default;
+  worker_pool(const worker_pool &) = delete;
+  worker_pool &operator=(const worker_pool &) = delete;
+  ~worker_pool() { stop(); }
+
+  int size() const { return static_cast<int>(threads_.size()) + 1; }
+
+  void resize(int num_threads) {
+    num_threads = std::max(num_threads, 1);
+    if (num_threads == size()) return;
+    stop();
+    // resize() and parallel_for() are called from the same thread, so nothing changes generation_ meanwhile
+    const uint64_t generation = generation_;
+    for (int i = 1; i < num_threads; i++) {
+      threads_.emplace_back([this, generation] { worker(generation); });
+    }
+  }
+
+  /**
+   * Calls fn(i) for every i in [0, n) and returns once all calls have completed.
+   */
+  void parallel_for(int n, const std::function<void(int)> &fn) {
+    if (threads_.empty() || n <= 1) {
+      for (int i = 0; i < n; i++) fn(i);
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mut_);
+      job_ = &fn;
+      job_size_ = n;
+      next_ = 0;
+      busy_ = threads_.size();
+      generation_++;
+    }
+    work_cv_.notify_all();
+    run(fn, n);
+    std::unique_lock<std::mutex> lock(mut_);
+    done_cv_.wait(lock, [&] { return busy_ == 0; });
+    job_ = nullptr;
+  }
+};
+
+namespace framer {
+
+enum class stream_mode { FILE, RTMP, HLS };
+enum class color_mode { BGRA, RGBA };
+// AUTO picks BT.709 for HD (720 lines and up) and BT.601 otherwise, which is what players assume for untagged video.
+enum class color_space { AUTO, BT601, BT709, BT2020 };
+enum class color_range { LIMITED, FULL };
+enum class rate_control { BITRATE, CRF, QP };
+enum class latency_mode { NORMAL, LOW };
+// AUTO leaves the choice to libavcodec, except in latency_mode::LOW where it means SLICE.
+enum class thread_type { AUTO, FRAME, SLICE };
+
+/**
+ * Encoder threads per stream, see set_threading(). -1 keeps libavcodec's default, 0 picks a count from the number of
+ * cores and the frame size. Frame threading has the best throughput but delays every frame by about one frame per
+ * thread, slice threading splits each frame and adds no delay. When running many streams, fewer threads per stream
+ * usually gives more total throughput.
+ */
+struct threading_options {
+  int video_threads = -1;
+  int audio_threads = -1;
+  thread_type video_thread_type = thread_type::AUTO;
+};
+
+/**
+ * The threading an encoder was opened with. Encoders that do their own threading, like libx264, leave the libavcodec
+ * threading inactive; then type is the one requested from them and a count of 0 means they picked their own. Encoders
+ * that don't thread at all report a count of 1.
+ */
+struct thread_info {
+  int count;
+  thread_type type;
+  bool internal;  // threads managed by the encoder library rather than by libavcodec
+};
+
+/**
+ * Video encoder selection and tuning, see set_encoder_options(). Empty strings and negative numbers keep the defaults:
+ * the container's default encoder at the constructor's bitrate, a GOP of 12, and for H.264 High profile at level 5.2.
+ * Preset, tune, profile and the CRF/QP value are passed to the encoder as AVOptions, so they take whatever the chosen
+ * encoder accepts, e.g. preset "veryfast" for libx264/libx265 or "8" for libsvtav1.
+ */
+struct encoder_options {
+  std::string codec;  // encoder name: "libx264", "libx265", "libvpx-vp9", "libsvtav1", "libaom-av1", "mpeg4", ..
+  std::string preset;
+  std::string tune;  // e.g. "zerolatency", "film", "animation"
+  rate_control rc = rate_control::BITRATE;
+  double quality = 23;  // CRF or QP, encoders that have neither (mpeg4) use it as a fixed qscale
+  std::string profile;  // e.g. "high", "main"
+  int level = -1;       // e.g. 41 for 4.1
+  int gop_size = -1;
+  int max_b_frames = -1;
+  std::vector<std::pair<std::string, std::string>> private_options;  // raw options, e.g. {"x264-params", "aq-mode=2"}
+};
+
+// Sample rate converter used when the encoder can't run at the source's rate.
+enum class resampler { SWR, SOXR };
+
+/**
+ * The audio source's format, and the audio encoder's bitrate. The encoder runs at the source's rate and channel layout
+ * if it supports them, otherwise framer converts, and the quality settings apply. SOXR needs an FFmpeg built with
+ * libsoxr.
+ */
+struct audio_options {
+  int sample_rate = 44100;
+  int channels = 2;  // the default layout for this many channels
+  size_t bitrate = 64000;
+  framer::resampler resampler = framer::resampler::SWR;
+  int filter_size = 32;     // swr's filter length, longer is sharper and slower
+  int soxr_precision = 20;  // bits, 20 is soxr's high quality, 28 very high
+};
+
+/**
+ * How record() produces audio. FREE encodes as fast as it can until stop(), PACED sleeps until each block is due on a
+ * monotonic clock, as a live source would deliver it, BATCH runs faster than real time until the target duration.
+ */
+enum class record_mode { FREE, PACED, BATCH };
+
+/**
+ * What a record() call produced, and what it cost. cpu_seconds is the CPU time of the thread that called record(),
+ * which generates, encodes and muxes the audio itself, so streamers running elsewhere in the process don't count.
+ */
+struct record_stats {
+  double audio_seconds = 0;
+  double wall_seconds = 0;
+  double cpu_seconds = 0;
+
+  double cpu_per_audio_second() const { return audio_seconds > 0 ? cpu_seconds / audio_seconds : 0; }
+};
+
+// CPU time used by the calling thread so far.
+inline double thread_cpu_seconds() {
+  timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) return 0;
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// One rung of an abr_streamer ladder.
+struct rendition {
+  int width;
+  int height;
+  size_t bitrate;
+};
+
+/**
+ * ColorMode parameter for basic_frame_streamer, either fixed at compile time (rgba, bgra), or taken from the
+ * constructor (dynamic_color_mode).
+ */
+template <color_mode M>
+struct static_color_mode {
+  static constexpr bool is_dynamic = false;
+  static constexpr color_mode value = M;
+};
+using rgba = static_color_mode<color_mode::RGBA>;
+using bgra = static_color_mode<color_mode::BGRA>;
+
+struct dynamic_color_mode {
+  static constexpr bool is_dynamic = true;
+  static constexpr color_mode value = color_mode::RGBA;  // default for the constructor
+};
+
+// The type-erased sources used by frame_streamer, basic_frame_streamer accepts any callable with these signatures.
+using video_source = std::function<void(std::vector<unsigned int> &pixels, int width, int height)>;
+using audio_source = std::function<void(float seconds, int fps, int num_channels, int16_t *channels)>;
+// Fills a whole block of nb_samples interleaved samples per channel, starting at start_seconds.
+using audio_block_source = std::function<void(
+    double start_seconds, int sample_rate, int num_channels, int nb_samples, int16_t *interleaved)>;
+
+// Interleaved sample formats accepted by add_audio_samples().
+enum class sample_format { S16, FLT };
+
+// Layout of the buffers an audio_float_source fills.
+enum class sample_layout { INTERLEAVED, PLANAR };
+
+// Fills nb_samples float samples per channel, starting at start_seconds. With sample_layout::PLANAR channels[i] is
+// channel i, with INTERLEAVED channels[0] holds all channels interleaved.
+using audio_float_source = std::function<void(
+    double start_seconds, int sample_rate, int num_channels, int nb_samples, float *const *channels)>;
+// Renders frame `index` of an offline render, see chunked_encoder. May be called from several threads at once.
+using indexed_video_source =
+    std::function<void(int64_t index, std::vector<unsigned int> &pixels, int width, int height)>;
+
+/**
+ * A muxed packet as reported to the packet callback. Timestamps are in time_base units of the output stream.
+ */
+struct packet_info {
+  int stream_index;
+  int64_t pts, dts, duration;
+  AVRational time_base;
+  int size;
+  bool keyframe;
+};
+
+using packet_callback = std::function<void(const packet_info &packet)>;
+
+// Time from add_frame() until the frame's packet has been muxed, pts is in the video stream's time base.
+using latency_callback = std::function<void(int64_t pts, std::chrono::microseconds latency)>;
+
+// Progress of a two-pass encode, pass is 1 or 2. frames_total is 0 in the first pass, the count is not known yet.
+using pass_progress_callback = std::function<void(int pass, int64_t frames_done, int64_t frames_total)>;
+
+/**
+ * Non-owning view of a packed 32-bit image. The stride is in bytes and may include padding (or be negative for
+ * bottom-up images), a stride of 0 means tightly packed rows. Without a layout the frame_streamer's color mode is used.
+ */
+struct image_view {
+  const uint8_t *data = nullptr;
+  int width = 0;
+  int height = 0;
+  ptrdiff_t stride = 0;
+  std::optional<color_mode> layout;
+
+  image_view() = default;
+  image_view(const void *data, int width, int height, ptrdiff_t stride = 0, std::optional<color_mode> layout = {})
+      : data(static_cast<const uint8_t *>(data)),
+        width(width),
+        height(height),
+        stride(stride ? stride : ptrdiff_t(width) * 4),
+        layout(layout) {}
+
+  const uint32_t *row(int y) const { return reinterpret_cast<const uint32_t *>(data + y * stride); }
+};
+
+// Layouts accepted by the planar add_frame() overload.
+enum class plane_format { YUV420P, NV12 };
+
+/**
+ * Caller-owned planes of a 4:2:0 frame: Y, U and V for YUV420P, or Y and interleaved UV for NV12.
+ */
+struct yuv_planes {
+  plane_format format = plane_format::YUV420P;
+  const uint8_t *data[3] = {nullptr, nullptr, nullptr};
+  int linesize[3] = {0, 0, 0};
+};
+
+/**
+ * Conversion coefficients for pixels in the given layout. cspace must be resolved, not AUTO.
+ */
+inline yuv::coefficients coefficients_for(color_space cspace, color_range crange, color_mode layout) {
+  double kr = 0.299, kb = 0.114;
+  if (cspace == color_space::BT709) {
+    kr = 0.2126, kb = 0.0722;
+  } else if (cspace == color_space::BT2020) {
+    kr = 0.2627, kb = 0.0593;
+  }
+  const bool full_range = crange == color_range::FULL;
+  return layout == color_mode::RGBA ? yuv::make_coefficients(kr, kb, full_range, 0, 1, 2)   // used by SFML
+                                    : yuv::make_coefficients(kr, kb, full_range, 2, 1, 0);  // used by Allegro 5
+}
+
+/**
+ * Converts a packed image to YUV420P planes on the pool.
+ */
+inline void convert_to_yuv420p(const image_view &src,
+                               const yuv::coefficients &k,
+                               uint8_t *const dst[3],
+                               const int dst_linesize[3],
+                               worker_pool &pool) {
+  const yuv::convert_row_fn convert_row = yuv::convert_row();
+
+  // Rows are converted in bands of whole row pairs, so that every band writes its own chroma rows. Small frames are
+  // not worth waking up the pool for.
+  const int min_pixels_per_band = 64 * 1024;
+  const int width = src.width, height = src.height;
+  const int row_pairs = (height + 1) / 2;
+  const int bands = std::max(1, std::min({pool.size(), row_pairs, width * height / min_pixels_per_band}));
+
+  pool.parallel_for(bands, [&](int band) {
+    const int first = 2 * (row_pairs * band / bands);
+    const int last = std::min(height, 2 * (row_pairs * (band + 1) / bands));
+    for (int y = first; y < last; y++) {
+      uint8_t *dst_y = dst[0] + y * dst_linesize[0];
+      if ((y % 2) == 0) {
+        uint8_t *dst_u = dst[1] + (y / 2) * dst_linesize[1];
+        uint8_t *dst_v = dst[2] + (y / 2) * dst_linesize[2];
+        convert_row(src.row(y), width, dst_y, dst_u, dst_v, k);
+      } else {
+        convert_row(src.row(y), width, dst_y, nullptr, nullptr, k);
+      }
+    }
+  });
+}
+
+/**
+ * Pixel buffer owned by a frame_pool. Every row starts on a 64-byte boundary.
+ */
+class frame_buffer {
+  struct aligned_delete {
+    void operator()(uint32_t *p) const { ::operator delete(p, std::align_val_t(alignment)); }
+  };
+  std::unique_ptr<uint32_t, aligned_delete> data_;
+  int width_;
+  int height_;
+  ptrdiff_t stride_;
+
+public:
+  static constexpr size_t alignment = 64;
+
+  frame_buffer(int width, int height)
+      : width_(width), height_(height), stride_((ptrdiff_t(width) * 4 + alignment - 1) / alignment * alignment) {
+    const size_t size = size_t(stride_) * height;
+    data_.reset(static_cast<uint32_t *>(::operator new(size, std::align_val_t(alignment))));
+    memset(data_.get(), 0, size);
+  }
+
+  uint32_t *data() { return data_.get(); }
+  uint32_t *row(int y) { return reinterpret_cast<uint32_t *>(reinterpret_cast<uint8_t *>(data_.get()) + y * stride_); }
+  int width() const { return width_; }
+  int height() const { return height_; }
+  // in bytes
+  ptrdiff_t stride() const { return stride_; }
+
+  image_view view(std::optional<color_mode> layout = {}) const {
+    return image_view(data_.get(), width_, height_, stride_, layout);
+  }
+};
+
+/**
+ * Bounded set of reusable frame buffers. Buffers are allocated on first use, acquire() blocks while all of them are
+ * handed out.
+ */
+class frame_pool {
+  std::mutex mut_;
+  std::condition_variable cv_;
+  std::vector<std::unique_ptr<frame_buffer>> buffers_;
+  std::vector<frame_buffer *> free_;
+  size_t capacity_;
+  size_t in_use_ = 0;
+  size_t high_water_mark_ = 0;
+
+public:
+  explicit frame_pool(size_t capacity = 4) : capacity_(capacity) {}
+
+  void set_capacity(size_t capacity) {
+    std::lock_guard<std::mutex> lock(mut_);
+    capacity_ = std::max(capacity, size_t(1));
+  }
+
+  frame_buffer *acquire(int width, int height) {
+    std::unique_lock<std::mutex> lock(mut_);
+    cv_.wait(lock, [&] { return !free_.empty() || buffers_.size() < capacity_; });
+    frame_buffer *buffer;
+    if (!free_.empty()) {
+      buffer = free_.back();
+      free_.pop_back();
+      if (buffer->width() != width || buffer->height() != height) {
+        *buffer = frame_buffer(width, height);  // the stream was re-initialized with a different size
+      }
+    } else {
+      buffers_.emplace_back(std::make_unique<frame_buffer>(width, height));
+      buffer = buffers_.back().get();
+    }
+    high_water_mark_ = std::max(high_water_mark_, ++in_use_);
+    return buffer;
+  }
+
+  void release(frame_buffer *buffer) {
+    {
+      std::lock_guard<std::mutex> lock(mut_);
+      free_.push_back(buffer);
+      in_use_--;
+    }
+    cv_.notify_one();
+  }
+
+  // largest number of buffers that were handed out at the same time
+  size_t high_water_mark() {
+    std::lock_guard<std::mutex> lock(mut_);
+    return high_water_mark_;
+  }
+};
+
+/**
+ * Cheap scene cut detection on the luma plane. The mean luma of 16x16 blocks, sampled at every fourth pixel of every
+ * fourth row, is compared with the previous frame's. A cut is a mean difference above threshold, as a fraction of the
+ * full range, at least min_gap frames after the previous cut, so that flashes don't start a GOP every frame. A
+ * negative min_gap means half a second at the fps passed to cut(), which may not be known yet when it's set.
+ */
+class scene_detector {
+  std::vector<int> previous_, current_;
+  int64_t since_cut_ = 0;
+
+public:
+  double threshold = 0.0;  // 0 disables detection
+  int min_gap = -1;
+
+  bool cut(const uint8_t *luma, int linesize, int width, int height, double fps) {
+    const int cols = width / 16, rows = height / 16;
+    current_.assign(size_t(cols) * rows, 0);
+    for (int by = 0; by < rows; by++) {
+      for (int y = 0; y < 16; y += 4) {
+        const uint8_t *row = luma + ptrdiff_t(by * 16 + y) * linesize;
+        for (int bx = 0; bx < cols; bx++) {
+          int &sum = current_[size_t(by) * cols + bx];
+          for (int x = 0; x < 16; x += 4) sum += row[bx * 16 + x];
+        }
+      }
+    }
+    since_cut_++;
+    bool cut = false;
+    if (!current_.empty() && previous_.size() == current_.size()) {
+      int64_t difference = 0;
+      for (size_t i = 0; i < current_.size(); i++) difference += std::abs(current_[i] - previous_[i]);
+      // 16 samples per block
+      const double score = double(difference) / (16.0 * 255.0 * double(current_.size()));
+      const int64_t gap = min_gap < 0 ? std::max(1, static_cast<int>(fps / 2)) : min_gap;
+      cut = score > threshold && since_cut_ >= gap;
+    }
+    std::swap(previous_, current_);
+    if (cut) since_cut_ = 0;
+    return cut;
+  }
+};
+
+// What add_frame() does in async mode when the queue is full.
+enum class backpressure { BLOCK, DROP_NEWEST, DROP_OLDEST };
+
+/**
+ * Bounded lock-free single-producer/single-consumer ring. Pushing and popping never take a lock, the blocking variants
+ * only do so when they actually have to sleep.
+ *
+ * To support dropping the oldest item, the producer may also pop. That's why items are copied out of their slot before
+ * the head is advanced with a CAS, and why they must be trivially copyable.
+ */
+template <typename T>
+class spsc_ring {
+  static_assert(std::is_trivially_copyable<T>::value, "items are copied out before their slot is released");
+
+  std::vector<T> slots_;
+  alignas(64) std::atomic<size_t> head_{0};  // next item to pop
+  alignas(64) std::atomic<size_t> tail_{0};  // next slot to push into
+  std::atomic<bool> closed_{false};
+  std::atomic<int> waiters_{0};
+  std::mutex wait_mut_;
+  std::condition_variable wait_cv_;
+
+  size_t next(size_t i) const { return i + 1 == slots_.size() ? 0 : i + 1; }
+
+  void notify() {
+    if (waiters_.load()) {
+      std::lock_guard<std::mutex> lock(wait_mut_);
+      wait_cv_.notify_all();
+    }
+  }
+
+  template <typename Pred>
+  void wait(Pred ready) {
+    waiters_++;
+    {
+      std::unique_lock<std::mutex> lock(wait_mut_);
+      wait_cv_.wait(lock, ready);
+    }
+    waiters_--;
+  }
+
+public:
+  // one slot always stays empty to tell a full ring from an empty one
+  explicit spsc_ring(size_t capacity) : slots_(std::max(capacity, size_t(1)) + 1) {}
+
+  bool empty() const { return head_.load() == tail_.load(); }
+  bool full() const { return next(tail_.load()) == head_.load(); }
+  size_t capacity() const { return slots_.size() - 1; }
+
+  bool try_push(const T &item) {
+    const size_t tail = tail_.load();
+    if (next(tail) == head_.load()) return false;
+    slots_[tail] = item;
+    tail_.store(next(tail));
+    notify();
+    return true;
+  }
+
+  bool try_pop(T &item) {
+    size_t head = head_.load();
+    do {
+      if (head == tail_.load()) return false;
+      item = slots_[head];
+    } while (!head_.compare_exchange_weak(head, next(head)));
+    notify();
+    return true;
+  }
+
+  void push_wait(const T &item) {
+    while (!try_push(item)) {
+      wait([&] { return !full(); });
+    }
+  }
+
+  /**
+   * Returns false once the ring is closed and drained.
+   */
+  bool pop_wait(T &item) {
+    while (!try_pop(item)) {
+      if (closed_) return false;
+      wait([&] { return !empty() || closed_; });
+    }
+    return true;
+  }
+
+  void close() {
+    closed_ = true;
+    std::lock_guard<std::mutex> lock(wait_mut_);
+    wait_cv_.notify_all();
+  }
+};
+
+/**
+ * Lock-free single-producer/single-consumer ring of float samples, written and read in blocks. head_ and tail_ count
+ * samples since the start and only ever grow, so the ring can be filled completely.
+ */
+class sample_ring {
+  std::vector<float> samples_;
+  alignas(64) std::atomic<size_t> head_{0};  // samples read
+  alignas(64) std::atomic<size_t> tail_{0};  // samples written
+
+public:
+  explicit sample_ring(size_t capacity) : samples_(std::max(capacity, size_t(1))) {}
+
+  size_t capacity() const { return samples_.size(); }
+  size_t size() const { return tail_.load() - head_.load(); }
+
+  // writes as much of src as fits, returns how much that was
+  size_t write(const float *src, size_t count) {
+    const size_t tail = tail_.load();
+    count = std::min(count, samples_.size() - (tail - head_.load()));
+    const size_t start = tail % samples_.size();
+    const size_t first = std::min(count, samples_.size() - start);
+    memcpy(samples_.data() + start, src, first * sizeof(float));
+    memcpy(samples_.data(), src + first, (count - first) * sizeof(float));
+    tail_.store(tail + count);
+    return count;
+  }
+
+  // reads up to count samples, returns how many there were
+  size_t read(float *dst, size_t count) {
+    const size_t head = head_.load();
+    count = std::min(count, tail_.load() - head);
+    const size_t start = head % samples_.size();
+    const size_t first = std::min(count, samples_.size() - start);
+    memcpy(dst, samples_.data() + start, first * sizeof(float));
+    memcpy(dst + first, samples_.data(), (count - first) * sizeof(float));
+    head_.store(head + count);
+    return count;
+  }
+
+  // drops up to count samples from the reading side, returns how many there were
+  size_t skip(size_t count) {
+    const size_t head = head_.load();
+    count = std::min(count, tail_.load() - head);
+    head_.store(head + count);
+    return count;
+  }
+};
+
+template <typename F>
+bool is_set(const F &) {
+  return true;
+}
+template <typename R, typename... Args>
+bool is_set(const std::function<R(Args...)> &f) {
+  return f != nullptr;
+}
+
+}  // namespace framer
+
+class frame_streamer_log;
+
+/**
+ * libav has a single process-wide log callback, this routes its messages to the frame_streamer_log they belong to.
+ * Messages are matched on their AVClass context, or one of its parents, and otherwise go to the instance that is
+ * working on the current thread. Messages nobody claims go to libav's default callback.
+ */
+struct frame_streamer_log_registry {
+  std::shared_mutex mut;
+  std::unordered_map<const void *, frame_streamer_log *> owners;
+
+  frame_streamer_log *find(void *ctx) {
+    while (ctx) {
+      auto it = owners.find(ctx);
+      if (it != owners.end()) return it->second;
+      const AVClass *avc = *(const AVClass **)ctx;
+      if (!avc || avc->parent_log_context_offset <= 0) break;
+      ctx = *(void **)((uint8_t *)ctx + avc->parent_log_context_offset);
+    }
+    return nullptr;
+  }
+
+  static frame_streamer_log_registry &get() {
+    static frame_streamer_log_registry registry;
+    return registry;
+  }
+};
+
+// the instance whose encode, mux or setup code is running on this thread
+inline thread_local frame_streamer_log *current_frame_streamer_log = nullptr;
 
 static void av_log_callback(void *ptr, int level, const char *fmt, va_list vl);
 
-class frame_streamer {
+/**
+ * Log state shared by all basic_frame_streamer instantiations, so that av_log_callback() does not depend on the
+ * template arguments.
+ */
+class frame_streamer_log {
+public:
+  // TODO: why does this need to be public
+  std::function<void(int level, const std::string &line)> log_callback = nullptr;
+  int log_callback_level = 0;
+  std::string log_callback_buffer;
+  framer::packet_callback packet_callback = nullptr;
+
+  frame_streamer_log() = default;
+  frame_streamer_log(const frame_streamer_log &) = delete;
+  frame_streamer_log &operator=(const frame_streamer_log &) = delete;
+  ~frame_streamer_log() { unregister_log_contexts(); }
+
+  /**
+   * Reports a muxed packet to the packet callback, and as a text line to the log callback if the libav log level
+   * includes AV_LOG_DEBUG. Nothing is formatted unless one of them wants it, so with neither set this is one branch.
+   */
+  void log_packet(const AVFormatContext *fmt_ctx, const AVPacket *pkt) {
+    if (packet_callback || log_callback) _report_packet(fmt_ctx, pkt);
+  }
+
+  /**
+   * Collects libav output a line at a time, libav may log from several threads. Returns true and moves the line out
+   * once it is complete, the caller passes it on to the log callback.
+   */
+  bool collect_log_line(int level, const char *fmt, va_list vl, int &line_level, std::string &line) {
+    char buf[512] = {0x00};
+    vsnprintf(buf, 512, fmt, vl);
+    buf[512 - 1] = 0x00;
+    std::lock_guard<std::mutex> lock(log_mut_);
+    log_callback_level = level;
+    log_callback_buffer.append(buf);
+    if (log_callback_buffer.empty() || log_callback_buffer.back() != '\n') return false;
+    line_level = log_callback_level;
+    line = std::move(log_callback_buffer);
+    log_callback_buffer.clear();
+    return true;
+  }
+
+protected:
+  // Marks this instance as the one working on the current thread, for messages from contexts that aren't registered.
+  class log_scope {
+    frame_streamer_log *prev_;
+
+  public:
+    explicit log_scope(frame_streamer_log *log) : prev_(current_frame_streamer_log) {
+      current_frame_streamer_log = log;
+    }
+    ~log_scope() { current_frame_streamer_log = prev_; }
+  };
+
+  void register_log_context(const void *ctx) {
+    if (!ctx) return;
+    auto &registry = frame_streamer_log_registry::get();
+    std::unique_lock<std::shared_mutex> lock(registry.mut);
+    registry.owners[ctx] = this;
+    log_contexts_.push_back(ctx);
+  }
+
+  // must happen before the contexts are freed, libav may reuse their addresses
+  void unregister_log_contexts() {
+    if (log_contexts_.empty()) return;
+    auto &registry = frame_streamer_log_registry::get();
+    std::unique_lock<std::shared_mutex> lock(registry.mut);
+    for (const void *ctx : log_contexts_) registry.owners.erase(ctx);
+    log_contexts_.clear();
+  }
+
+  static void install_log_callback() {
+    static std::once_flag installed;
+    std::call_once(installed, [] { av_log_set_callback(av_log_callback); });
+  }
+
+private:
+  std::mutex log_mut_;
+  std::vector<const void *> log_contexts_;
+
+  // kept out of line, so the disabled check above is all that gets inlined into the write path
+  __attribute__((noinline)) void _report_packet(const AVFormatContext *fmt_ctx, const AVPacket *pkt) {
+    AVRational time_base = fmt_ctx->streams[pkt->stream_index]->time_base;
+    if (packet_callback) {
+      packet_callback({pkt->stream_index,
+                       pkt->pts,
+                       pkt->dts,
+                       pkt->duration,
+                       time_base,
+                       pkt->size,
+                       (pkt->flags & AV_PKT_FLAG_KEY) != 0});
+    }
+    if (log_callback && av_log_get_level() >= AV_LOG_DEBUG) {
+      char buf[512] = {0x00};
+      snprintf(buf,
+               512,
+               "pts:%s pts_time:%s dts:%s dts_time:%s duration:%s duration_time:%s stream_index:%d\n",
+               av_ts2str(pkt->pts),
+               av_ts2timestr(pkt->pts, &time_base),
+               av_ts2str(pkt->dts),
+               av_ts2timestr(pkt->dts, &time_base),
+               av_ts2str(pkt->duration),
+               av_ts2timestr(pkt->duration, &time_base),
+               pkt->stream_index);
+      buf[512 - 1] = 0x00;
+      log_callback(AV_LOG_DEBUG, buf);
+    }
+  }
+};
+
+static void av_log_callback(void *ptr, int level, const char *fmt, va_list vl) {
+  // libav hands every message to the callback, filtering by level is up to us
+  if (level > av_log_get_level()) return;
+
+  auto &registry = frame_streamer_log_registry::get();
+  std::function<void(int level, const std::string &line)> callback;
+  int line_level = 0;
+  std::string line;
+  {
+    std::shared_lock<std::shared_mutex> lock(registry.mut);  // keeps the owner from unregistering meanwhile
+    frame_streamer_log *owner = registry.find(ptr);
+    if (!owner) owner = current_frame_streamer_log;
+    if (owner && owner->log_callback) {
+      if (!owner->collect_log_line(level, fmt, vl, line_level, line)) return;
+      callback = owner->log_callback;
+    }
+  }
+  if (!callback) {
+    av_log_default_callback(ptr, level, fmt, vl);
+    return;
+  }
+  // called without the lock, the callback may create or destroy streamers, which register and unregister contexts
+  callback(line_level, line);
+}
+
+/**
+ * Encoder for a stream of video frames and/or audio samples.
+ *
+ * The template arguments allow the compiler to inline the pixel layout and the user's generators into the conversion
+ * and sample loops: ColorMode is framer::rgba, framer::bgra or framer::dynamic_color_mode, VideoSource and AudioSource
+ * are callables with the signatures of framer::video_source and framer::audio_source. frame_streamer is the
+ * type-erased default.
+ */
+template <typename ColorMode, typename VideoSource, typename AudioSource>
+class basic_frame_streamer : public frame_streamer_log {
 private:
   // int STREAM_DURATION   = 10 /* seconds */;
   // int STREAM_FRAME_RATE = 25 /* 25 images/s */;
@@ -169,6 +1303,8 @@ private:
     AVFrame *frame;
     AVFrame *tmp_frame;
 
+    AVPacket *tmp_pkt;  // reused for every packet the encoder returns
+
     float t, tincr, tincr2;
 
     struct SwsContext *sws_ctx;
@@ -185,18 +1321,19 @@ private:
   AVDictionary *opt = nullptr;
 
 public:
-  enum class stream_mode { FILE, RTMP, HLS };
-  enum class color_mode { BGRA, RGBA };
-
-  // TODO: why does this need to be public
-  std::function<void(int level, const std::string &line)> log_callback = nullptr;
-  int log_callback_level = 0;
-  std::string log_callback_buffer;
+  using stream_mode = framer::stream_mode;
+  using color_mode = framer::color_mode;
+  using color_space = framer::color_space;
+  using color_range = framer::color_range;
 
 private:
   bool initialized_;
   stream_mode mode_;
   color_mode cmode_;
+  color_space cspace_;
+  color_range crange_;
+  yuv::coefficients rgba_coefficients_;
+  yuv::coefficients bgra_coefficients_;
   std::string filename_;
   size_t bitrate_;
   size_t fps_;
@@ -205,46 +1342,140 @@ private:
   std::chrono::high_resolution_clock::time_point current_time_;
   std::chrono::steady_clock::time_point start_time_;
   int num_threads_ = -1;  // sentinel value for do not override default
-  std::function<void(float seconds, int fps, int num_channels, int16_t *channels)> audio_callback_ = nullptr;
-  std::function<void(std::vector<unsigned int> &pixels, int width, int height)> video_callback_ = nullptr;
+  bool force_keyframe_ = false;  // for the frame being converted
+  framer::scene_detector scene_detector_;
+  framer::threading_options threading_;
+  framer::encoder_options encoder_options_;
+  framer::latency_mode latency_mode_ = framer::latency_mode::NORMAL;
+  bool intra_refresh_ = false;
+
+  // add_frame() times by video pts, for the latency callback
+  framer::latency_callback latency_callback_;
+  std::mutex latency_mut_;
+  std::deque<std::pair<int64_t, std::chrono::steady_clock::time_point>> latency_marks_;
+  worker_pool convert_pool_;
+  framer::frame_pool frame_pool_;
+
+  // async mode, see set_async()
+  struct queued_frame {
+    framer::frame_buffer *buffer;  // packed pixels, owned by frame_pool_
+    AVFrame *planes;               // or YUV planes
+    std::optional<color_mode> layout;
+    std::chrono::steady_clock::time_point time;
+    bool keyframe;
+  };
+  std::unique_ptr<framer::spsc_ring<queued_frame>> queue_;
+  framer::backpressure backpressure_ = framer::backpressure::BLOCK;
+  std::atomic<size_t> dropped_frames_{0};
+  std::chrono::steady_clock::time_point frame_time_;  // when the frame being converted was added
+
+  // the pipeline stages behind the queue: convert -> encode -> mux
+  std::unique_ptr<framer::spsc_ring<AVFrame *>> converted_;
+  std::unique_ptr<framer::spsc_ring<AVPacket *>> packets_;
+  std::vector<AVFrame *> convert_targets_;  // ost->frame is cycled through these
+  size_t next_convert_target_ = 0;
+  std::thread convert_thread_, encode_thread_, mux_thread_;
+
+  // audio on a thread of its own, see set_audio_thread()
+  bool audio_thread_enabled_ = false;
+  std::thread audio_thread_;
+  std::unique_ptr<framer::spsc_ring<AVPacket *>> audio_packets_;
+  std::mutex audio_mut_;
+  std::condition_variable audio_cv_;
+  int64_t video_progress_ = 0;  // next video pts, audio is encoded up to here
+  bool audio_stop_ = false;
+
+  // two-pass mode, see set_two_pass()
+  int pass_ = 0;           // 1 while frames go to the first pass, 2 while the spool is encoded
+  bool analysis_ = false;  // this is the first pass of another streamer
+  std::unique_ptr<basic_frame_streamer> first_pass_;
+  std::FILE *spool_ = nullptr;  // converted frames of the first pass, owned by the streamer with pass_ != 0
+  std::vector<uint8_t> spool_buffer_;
+  int64_t spooled_frames_ = 0;
+  std::vector<int64_t> spooled_keyframes_;  // frames of the spool that were keyframes in the first pass
+  std::string stats_;  // libavcodec's stats_out, for encoders that don't keep their own stats file
+  std::string last_stats_out_;  // what stats_out held when it was last read, encoders may leave it unchanged
+  framer::pass_progress_callback pass_progress_;
+  std::optional<AudioSource> audio_callback_;
+  framer::audio_options audio_options_;
+  framer::audio_block_source audio_block_callback_;
+  framer::audio_float_source audio_float_callback_;
+  framer::sample_layout audio_float_layout_ = framer::sample_layout::PLANAR;
+  // how the callback's samples reach the encoder's frame
+  enum class audio_path { CONVERT, DIRECT, DEINTERLEAVE, RESAMPLE };
+  audio_path audio_path_ = audio_path::CONVERT;
+  // add_audio_samples() converts to interleaved float in the source format and appends to the ring
+  std::unique_ptr<framer::sample_ring> audio_ring_;
+  SwrContext *ingest_swr_ = nullptr;
+  framer::sample_format ingest_format_ = framer::sample_format::FLT;
+  int ingest_rate_ = 0, ingest_channels_ = 0;
+  std::vector<float> ingest_buffer_;
+  std::atomic<size_t> dropped_audio_samples_{0}, audio_underrun_samples_{0};
+  size_t audio_owed_ = 0;  // samples per channel of silence not yet made up for by dropping late samples
+  // RESAMPLE only: encoder frames are cut from the FIFO, source_samples_ counts what the callback produced
+  AVAudioFifo *audio_fifo_ = nullptr;
+  AVFrame *resampled_ = nullptr;
+  int64_t source_samples_ = 0;
+  std::vector<int16_t> audio_scratch_;  // one sample per channel, for the per-sample callback
+  std::optional<VideoSource> video_callback_;
   int64_t audio_pts = 0;
   int64_t video_pts = 0;
   bool streams_configured_ = false;
   bool running_ = true;
 
 public:
-  frame_streamer(std::string filename,
-                 size_t bitrate,
-                 int fps,
-                 int width,
-                 int height,
-                 stream_mode mode = stream_mode::FILE,
-                 color_mode cmode = color_mode::RGBA)
+  basic_frame_streamer(std::string filename,
+                       size_t bitrate,
+                       int fps,
+                       int width,
+                       int height,
+                       stream_mode mode = stream_mode::FILE,
+                       color_mode cmode = ColorMode::value,
+                       color_space cspace = color_space::AUTO,
+                       color_range crange = color_range::LIMITED,
+                       framer::audio_options audio = {})
       : initialized_(true),
         mode_(mode),
-        cmode_(cmode),
+        cmode_(ColorMode::is_dynamic ? cmode : ColorMode::value),
+        cspace_(cspace),
+        crange_(crange),
         filename_(std::move(filename)),
         bitrate_(bitrate),
         fps_(fps),
         width_(width),
         height_(height),
         current_time_(std::chrono::high_resolution_clock::now()),
-        start_time_(std::chrono::steady_clock::now()) {}
+        start_time_(std::chrono::steady_clock::now()),
+        audio_options_(std::move(audio)) {}
 
   /**
    * Constructor that does not yet take all parameters, the idea is to use initialize() later.
    */
-  frame_streamer(std::string filename, stream_mode mode = stream_mode::FILE, color_mode cmode = color_mode::RGBA)
+  basic_frame_streamer(std::string filename,
+                       stream_mode mode = stream_mode::FILE,
+                       color_mode cmode = ColorMode::value,
+                       color_space cspace = color_space::AUTO,
+                       color_range crange = color_range::LIMITED,
+                       framer::audio_options audio = {})
       : initialized_(false),
         mode_(mode),
-        cmode_(cmode),
+        cmode_(ColorMode::is_dynamic ? cmode : ColorMode::value),
+        cspace_(cspace),
+        crange_(crange),
         filename_(std::move(filename)),
         bitrate_(0),
         fps_(0),
         width_(0),
         height_(0),
         current_time_(std::chrono::high_resolution_clock::now()),
-        start_time_(std::chrono::steady_clock::now()) {}
+        start_time_(std::chrono::steady_clock::now()),
+        audio_options_(std::move(audio)) {}
+
+  ~basic_frame_streamer() {
+    _stop_pipeline();
+    if (pass_ != 0) _remove_pass_files();
+    swr_free(&ingest_swr_);
+  }
 
   void initialize(size_t bitrate, int width, int height, int fps) {
     bitrate_ = bitrate;
@@ -253,38 +1484,236 @@ public:
     fps_ = fps;
     audio_pts = 0;
     video_pts = 0;
+    source_samples_ = 0;
     initialized_ = true;
     _configure_streams();
   }
 
+  void initialize(size_t bitrate, int width, int height, int fps, const framer::audio_options &audio) {
+    audio_options_ = audio;
+    initialize(bitrate, width, height, fps);
+  }
+
+  /**
+   * Receives libav log lines up to av_log_get_level(). Raise it to AV_LOG_DEBUG to also get a line per muxed packet.
+   */
   void set_log_callback(std::function<void(int level, const std::string &line)> log_callback) {
     this->log_callback = log_callback;
   }
 
-  void set_audio_callback(
-      std::function<void(float seconds, int fps, int num_channels, int16_t *channels)> audio_callback) {
-    this->audio_callback_ = audio_callback;
+  /**
+   * Receives a record for every muxed packet, from whichever thread muxes (see set_async()).
+   */
+  void set_packet_callback(framer::packet_callback packet_callback) {
+    this->packet_callback = std::move(packet_callback);
+  }
+
+  /**
+   * Called once per sample, for all channels at once. set_audio_block_callback() is much cheaper, this one is filled
+   * into the same blocks sample by sample.
+   */
+  void set_audio_callback(AudioSource audio_callback) {
+    this->audio_callback_.emplace(std::move(audio_callback));
+    _configure_streams();
+  }
+
+  /**
+   * Called once per audio frame (usually 1024 samples) to fill all of its samples at once, takes precedence over
+   * set_audio_callback().
+   */
+  void set_audio_block_callback(framer::audio_block_source audio_block_callback) {
+    audio_block_callback_ = std::move(audio_block_callback);
+    _configure_streams();
+  }
+
+  /**
+   * Float samples, planar or interleaved, takes precedence over the other audio callbacks. If the encoder takes the
+   * same layout (AAC and Opus take planar float) the callback writes straight into the encoder's frame, interleaved
+   * samples for a planar encoder are only deinterleaved. Neither goes through swresample or loses precision to int16_t.
+   * Must be called before the streams are configured, that is before the other audio callbacks.
+   */
+  void set_audio_float_callback(framer::audio_float_source audio_float_callback,
+                                framer::sample_layout layout = framer::sample_layout::PLANAR) {
+    if (streams_configured_) {
+      throw std::runtime_error("set_audio_float_callback() must be called before the streams are configured");
+    }
+    audio_float_callback_ = std::move(audio_float_callback);
+    audio_float_layout_ = layout;
+    _configure_streams();
+  }
+
+  /**
+   * Takes audio pushed through add_audio_samples() instead of from a callback, buffered for up to buffer_seconds.
+   * Must be called before the streams are configured.
+   *
+   * Audio timestamps count samples. When the buffer runs dry the encoder fills in silence and moves on, and as many of
+   * the samples that arrive afterwards are dropped, since their time has already been filled. So a source that runs a
+   * little slow loses samples instead of drifting behind the video, and one that runs fast fills the buffer and loses
+   * them in add_audio_samples(). Either way the audio stays within buffer_seconds of the video.
+   */
+  void enable_audio_samples(double buffer_seconds = 1.0) {
+    if (streams_configured_) {
+      throw std::runtime_error("enable_audio_samples() must be called before the streams are configured");
+    }
+    const double samples = buffer_seconds * audio_options_.sample_rate * audio_options_.channels;
+    audio_ring_ = std::make_unique<framer::sample_ring>(static_cast<size_t>(samples));
     _configure_streams();
   }
 
-  void set_video_callback(
-      std::function<void(std::vector<unsigned int> &pixels, int width, int height)> video_callback) {
-    this->video_callback_ = video_callback;
+  /**
+   * Appends interleaved samples to the audio buffer, from any one thread, without waiting for the encoder. Samples at
+   * another rate or channel count than framer::audio_options are converted on the way in. Samples that don't fit
+   * into the buffer are dropped, and when the encoder needs audio that hasn't been added yet it gets silence, see
+   * dropped_audio_samples() and audio_underrun_samples(). Needs enable_audio_samples().
+   */
+  void add_audio_samples(
+      const void *data, int nb_samples, framer::sample_format format, int sample_rate, int channels) {
+    if (!audio_ring_) {
+      throw std::runtime_error("add_audio_samples() needs enable_audio_samples()");
+    }
+    const int out_channels = audio_options_.channels;
+    const float *samples = nullptr;
+    size_t count = 0;
+    if (sample_rate == audio_options_.sample_rate && channels == out_channels) {
+      count = size_t(nb_samples) * channels;
+      if (format == framer::sample_format::FLT) {
+        samples = static_cast<const float *>(data);
+      } else {
+        const int16_t *in = static_cast<const int16_t *>(data);
+        ingest_buffer_.resize(count);
+        for (size_t i = 0; i < count; i++) ingest_buffer_[i] = in[i] * (1.0f / 32768.0f);
+        samples = ingest_buffer_.data();
+      }
+    } else {
+      _configure_ingest(format, sample_rate, channels);
+      const int capacity = swr_get_out_samples(ingest_swr_, nb_samples);
+      ingest_buffer_.resize(size_t(std::max(capacity, 0)) * out_channels);
+      uint8_t *out[] = {reinterpret_cast<uint8_t *>(ingest_buffer_.data())};
+      const uint8_t *in[] = {static_cast<const uint8_t *>(data)};
+      const int converted = swr_convert(ingest_swr_, out, capacity, in, nb_samples);
+      if (converted < 0) {
+        fprintf(stderr, "Error while resampling\n");
+        exit(1);
+      }
+      samples = ingest_buffer_.data();
+      count = size_t(converted) * out_channels;
+    }
+    // whole sample frames only, the encoder side reads interleaved channels
+    const size_t room = (audio_ring_->capacity() - audio_ring_->size()) / out_channels * out_channels;
+    const size_t written = audio_ring_->write(samples, std::min(count, room));
+    if (written < count) dropped_audio_samples_ += (count - written) / out_channels;
+  }
+
+  // samples per channel dropped because the buffer was full, or because silence already stood in for them
+  size_t dropped_audio_samples() const { return dropped_audio_samples_; }
+  // samples per channel of silence the encoder got because add_audio_samples() fell behind
+  size_t audio_underrun_samples() const { return audio_underrun_samples_; }
+
+  void set_video_callback(VideoSource video_callback) {
+    this->video_callback_.emplace(std::move(video_callback));
     _configure_streams();
   }
 
-  bool _is_audio_enabled() { return audio_callback_ != nullptr; }
-  bool _is_video_callback_enabled() { return video_callback_ != nullptr; }
+  bool _is_audio_enabled() {
+    return (audio_callback_ && framer::is_set(*audio_callback_)) || audio_block_callback_ != nullptr ||
+           audio_float_callback_ != nullptr || audio_ring_ != nullptr;
+  }
+  bool _is_video_callback_enabled() { return video_callback_ && framer::is_set(*video_callback_); }
+
+  /**
+   * Number of threads used by the codecs, and for the color conversion. By default the codecs pick their own thread
+   * count and the color conversion uses all cores.
+   */
+  void set_num_threads(int num_threads) {
+    num_threads_ = num_threads;
+    threading_.video_threads = threading_.audio_threads = num_threads;
+  }
+
+  /**
+   * Thread counts per encoder, and frame or slice threading for video. Must be called before the streams are
+   * configured, after set_num_threads() if both are used.
+   */
+  void set_threading(const framer::threading_options &threading) { threading_ = threading; }
 
-  void set_num_threads(int num_threads) { num_threads_ = num_threads; }
+  /**
+   * The threading the encoders were actually opened with, known once the streams are configured.
+   */
+  framer::thread_info video_threading() const { return _threading(video_st.enc); }
+  framer::thread_info audio_threading() const { return _threading(audio_st.enc); }
 
   bool is_streaming() { return mode_ != stream_mode::FILE; }
 
+  /**
+   * Pixel format of the encoder, YUV420P by default. Use NV12 to pass NV12 planes to the encoder without conversion,
+   * must be called before the streams are configured.
+   */
+  void set_pixel_format(framer::plane_format format) {
+    STREAM_PIX_FMT = format == framer::plane_format::NV12 ? AV_PIX_FMT_NV12 : AV_PIX_FMT_YUV420P;
+  }
+
+  /**
+   * Selects and tunes the video encoder, must be called before the streams are configured. Options the encoder does not
+   * know are reported on stderr when it is opened.
+   */
+  void set_encoder_options(framer::encoder_options options) { encoder_options_ = std::move(options); }
+
+  /**
+   * latency_mode::LOW is meant for RTMP and HLS: zerolatency tuning without lookahead or B-frames, slice instead of
+   * frame threading, and the muxer writes every packet out right away. Intra refresh replaces keyframes with a moving
+   * column of intra blocks, which avoids bitrate spikes, but HLS needs keyframes to cut segments. With HLS the segment
+   * length and the player's buffer still dominate the latency. Must be called before the streams are configured.
+   */
+  void set_latency_mode(framer::latency_mode mode, bool intra_refresh = false) {
+    latency_mode_ = mode;
+    intra_refresh_ = intra_refresh;
+  }
+
+  /**
+   * Receives the encode plus mux latency of every video frame, called from the thread that muxes.
+   */
+  void set_latency_callback(framer::latency_callback latency_callback) {
+    latency_callback_ = std::move(latency_callback);
+  }
+
+  /**
+   * Forces a keyframe at scene cuts, found by comparing the downscaled luma of consecutive frames. The threshold is the
+   * mean difference as a fraction of the full range, 0.3 catches hard cuts but not fast motion, 0 turns detection off.
+   * Cuts are at least min_gap frames apart, half a second by default. With keyframes at cuts, plus the ones forced
+   * through add_frame(), gop_size (see set_encoder_options()) can be much longer than the default of 12.
+   */
+  void set_scene_cut_detection(double threshold = 0.3, int min_gap = -1) {
+    scene_detector_.threshold = threshold;
+    scene_detector_.min_gap = min_gap;
+  }
+
+  /**
+   * Two-pass encoding of a file at the target bitrate. Until finalize() frames go to a fast first pass, which analyses
+   * them and spools the converted frames to "<filename>.spool". finalize() then encodes the spool again with the
+   * statistics of the first pass into the output, so the frames are only rendered and converted once. The spool is
+   * uncompressed (width * height * 1.5 bytes per frame) and removed afterwards. Audio is only encoded in the second
+   * pass. Must be called before the streams are configured.
+   */
+  void set_two_pass(framer::pass_progress_callback progress = nullptr) {
+    if (mode_ != stream_mode::FILE) {
+      throw std::runtime_error("two-pass encoding needs stream_mode::FILE");
+    }
+    if (streams_configured_) {
+      throw std::runtime_error("set_two_pass() must be called before the streams are configured");
+    }
+    spool_ = fopen(_pass_file(".spool").c_str(), "w+b");
+    if (!spool_) {
+      throw std::runtime_error("could not create the two-pass spool file");
+    }
+    pass_ = 1;
+    pass_progress_ = std::move(progress);
+  }
+
 private:
   int _configure_streams() {
-    if (streams_configured_) {
-      return 0;
+    if (streams_configured_ || pass_ == 1) {
+      return 0;  // in two-pass mode the output is only opened for the second pass
     }
+    log_scope scope(this);
     /* Initialize libavcodec, and register all codecs and formats. */
 #if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 9, 100)
     av_register_all();
@@ -298,7 +1727,8 @@ private:
     /* allocate the output media context */
     switch (mode_) {
       case stream_mode::FILE:
-        avformat_alloc_output_context2(&oc, nullptr, nullptr, filename_.c_str());
+        // the first pass of a two-pass encode only needs the statistics, its packets are discarded
+        avformat_alloc_output_context2(&oc, nullptr, analysis_ ? "null" : nullptr, filename_.c_str());
         break;
       case stream_mode::RTMP:
         avformat_alloc_output_context2(&oc, nullptr, "flv", filename_.c_str());
@@ -318,14 +1748,22 @@ private:
       printf("Could not deduce output format from file extension: using MPEG.\n");
       avformat_alloc_output_context2(&oc, nullptr, "mpeg", filename_.c_str());
     }
-    if (!oc) return 1;
+    if (!oc) return 1;
+
+    fmt = oc->oformat;
+
+    if (latency_mode_ == framer::latency_mode::LOW) {
+      oc->flags |= AVFMT_FLAG_FLUSH_PACKETS;         // no buffering in avio
+      oc->max_interleave_delta = AV_TIME_BASE / 10;  // don't hold packets back for more than 100ms to interleave
+    }
 
-    fmt = oc->oformat;
+    _configure_color_space();
 
     /* Add the audio and video streams using the default format codecs
      * and initialize the codecs. */
     if (fmt->video_codec != AV_CODEC_ID_NONE) {
-      add_stream(&video_st, oc, &video_codec, fmt->video_codec);
+      const AVCodecID video_codec_id = analysis_ ? _file_video_codec() : fmt->video_codec;
+      add_stream(&video_st, oc, &video_codec, video_codec_id, encoder_options_.codec);
       have_video = 1;
       encode_video = 1;
     }
@@ -338,9 +1776,12 @@ private:
     }
 
     if (log_callback != nullptr) {
-      global_this = this;
-      av_log_set_callback(av_log_callback);
+      install_log_callback();
     }
+    register_log_context(oc);
+    register_log_context(oc->priv_data);
+    if (have_video) register_log_context(video_st.enc);
+    if (have_audio) register_log_context(audio_st.enc);
 
     /* Now that all the parameters are set, we can open the audio and
      * video codecs and allocate the necessary encode buffers. */
@@ -361,6 +1802,7 @@ private:
         fprintf(stderr, "Could not open '%s': %s\n", filename_.c_str(), av_err2str(ret));
         throw std::runtime_error("Continuing will fail in mux.c, because avformat_write_header is not optional.");
       }
+      register_log_context(oc->pb);
     }
 
     /* Write the stream header, if any. */
@@ -373,38 +1815,477 @@ private:
     return 0;
   }
 
-  std::vector<uint32_t> *pixels_ = nullptr;  // temporary pointer
+  // the codec the output file would get, for the first pass that muxes into the null format
+  AVCodecID _file_video_codec() const {
+    const AVOutputFormat *file_fmt = av_guess_format(nullptr, filename_.c_str(), nullptr);
+    if (!file_fmt) file_fmt = av_guess_format("mpeg", nullptr, nullptr);
+    return file_fmt ? file_fmt->video_codec : AV_CODEC_ID_NONE;
+  }
 
-public:
-  void add_frame(std::vector<uint32_t> &pixels) {
+  std::string _pass_file(const char *suffix) const { return filename_ + suffix; }
+
+  void _remove_pass_files() {
+    if (spool_) fclose(spool_);
+    spool_ = nullptr;
+    // x264 writes its statistics to ".stats", and the macroblock tree next to it
+    for (const char *suffix : {".spool", ".stats", ".stats.mbtree"}) {
+      std::remove(_pass_file(suffix).c_str());
+    }
+  }
+
+  basic_frame_streamer &_first_pass() {
+    if (!first_pass_) {
+      first_pass_ = std::make_unique<basic_frame_streamer>(
+          filename_, bitrate_, (int)fps_, (int)width_, (int)height_, mode_, cmode_, cspace_, crange_);
+      first_pass_->analysis_ = true;
+      first_pass_->spool_ = spool_;
+      first_pass_->STREAM_PIX_FMT = STREAM_PIX_FMT;
+      first_pass_->num_threads_ = num_threads_;
+      first_pass_->threading_ = threading_;
+      first_pass_->encoder_options_ = encoder_options_;
+      first_pass_->scene_detector_ = scene_detector_;
+      first_pass_->log_callback = log_callback;
+    }
+    return *first_pass_;
+  }
+
+  void _report_pass_progress() {
+    if (pass_progress_) pass_progress_(1, first_pass_->spooled_frames_, 0);
+  }
+
+  // the spool holds the encoder's frames back to back, tightly packed
+  void _spool_frame(const AVFrame *frame) {
+    const AVPixelFormat format = static_cast<AVPixelFormat>(frame->format);
+    const int size = av_image_get_buffer_size(format, frame->width, frame->height, 1);
+    spool_buffer_.resize(size);
+    av_image_copy_to_buffer(spool_buffer_.data(),
+                            size,
+                            (const uint8_t *const *)frame->data,
+                            frame->linesize,
+                            format,
+                            frame->width,
+                            frame->height,
+                            1);
+    if (fwrite(spool_buffer_.data(), 1, size, spool_) != size_t(size)) {
+      fprintf(stderr, "Could not write the two-pass spool\n");
+      exit(1);
+    }
+    spooled_frames_++;
+  }
+
+  /**
+   * Finishes the first pass, then feeds the spooled frames through this streamer, which now opens the output with the
+   * first pass's statistics.
+   */
+  void _second_pass() {
+    int64_t total = 0;
+    std::vector<int64_t> keyframes;
+    if (first_pass_) {
+      first_pass_->finalize();
+      stats_ = std::move(first_pass_->stats_);
+      total = first_pass_->spooled_frames_;
+      keyframes = std::move(first_pass_->spooled_keyframes_);
+      first_pass_.reset();
+    }
+    pass_ = 2;
+    scene_detector_.threshold = 0;  // the first pass found the cuts already
+    _configure_streams();
+
+    const int width = static_cast<int>(width_), height = static_cast<int>(height_);
+    std::vector<uint8_t> buffer(av_image_get_buffer_size(STREAM_PIX_FMT, width, height, 1));
+    framer::yuv_planes planes;
+    planes.format = STREAM_PIX_FMT == AV_PIX_FMT_NV12 ? framer::plane_format::NV12 : framer::plane_format::YUV420P;
+    uint8_t *data[4];
+    int linesize[4];
+    av_image_fill_arrays(data, linesize, buffer.data(), STREAM_PIX_FMT, width, height, 1);
+    for (int i = 0; i < 3; i++) {
+      planes.data[i] = data[i];
+      planes.linesize[i] = linesize[i];
+    }
+    rewind(spool_);
+    auto keyframe = keyframes.begin();
+    for (int64_t i = 0; i < total; i++) {
+      if (fread(buffer.data(), 1, buffer.size(), spool_) != buffer.size()) {
+        fprintf(stderr, "Could not read the two-pass spool\n");
+        exit(1);
+      }
+      const bool force_keyframe = keyframe != keyframes.end() && *keyframe == i;
+      if (force_keyframe) ++keyframe;
+      add_frame(planes, nullptr, force_keyframe);  // copied in async mode, the buffer is reused
+      if (pass_progress_) pass_progress_(2, i + 1, total);
+    }
+  }
+
+  void _configure_color_space() {
+    if (cspace_ == color_space::AUTO) {
+      cspace_ = height_ >= 720 ? color_space::BT709 : color_space::BT601;
+    }
+    rgba_coefficients_ = framer::coefficients_for(cspace_, crange_, color_mode::RGBA);
+    bgra_coefficients_ = framer::coefficients_for(cspace_, crange_, color_mode::BGRA);
+  }
+
+  const yuv::coefficients &_coefficients(color_mode cmode) const {
+    return cmode == color_mode::RGBA ? rgba_coefficients_ : bgra_coefficients_;
+  }
+
+  color_mode _color_mode() const {
+    if constexpr (ColorMode::is_dynamic) {
+      return cmode_;
+    } else {
+      return ColorMode::value;
+    }
+  }
+
+  framer::image_view pixels_;  // frame being converted
+  struct SwsContext *planes_sws_ctx_ = nullptr;
+
+  void _write_planes(AVFrame *frame) {
+    _interleave([&] {
+      AVFrame *prepared = get_video_frame(&video_st, frame);
+      int ret = write_video_frame(oc, &video_st, prepared);
+      av_frame_free(&prepared);
+      return ret;
+    });
+  }
+
+  void _release(const queued_frame &item) {
+    if (item.buffer) frame_pool_.release(item.buffer);
+    if (item.planes) {
+      AVFrame *planes = item.planes;
+      av_frame_free(&planes);
+    }
+  }
+
+  void _enqueue(const queued_frame &item) {
+    _configure_streams();
+    if (!convert_thread_.joinable()) {
+      _start_pipeline();
+    }
+    switch (backpressure_) {
+      case framer::backpressure::BLOCK:
+        queue_->push_wait(item);
+        break;
+      case framer::backpressure::DROP_NEWEST:
+        if (!queue_->try_push(item)) {
+          _release(item);
+          dropped_frames_++;
+        }
+        break;
+      case framer::backpressure::DROP_OLDEST:
+        while (!queue_->try_push(item)) {
+          queued_frame oldest;
+          if (queue_->try_pop(oldest)) {
+            _release(oldest);
+            dropped_frames_++;
+          }
+        }
+        break;
+    }
+  }
+
+  void _start_pipeline() {
+    // converting frame N+1 while frame N is encoded
+    converted_ = std::make_unique<framer::spsc_ring<AVFrame *>>(2);
+    _start_muxing();
+    // queued, being encoded and being converted, plus ost->frame itself
+    for (size_t i = convert_targets_.size(); i < converted_->capacity() + 1; i++) {
+      AVFrame *frame = alloc_picture(video_st.enc->pix_fmt, video_st.enc->width, video_st.enc->height);
+      if (!frame) {
+        fprintf(stderr, "Could not allocate video frame\n");
+        exit(1);
+      }
+      convert_targets_.push_back(frame);
+    }
+    encode_thread_ = std::thread([this] { _encode_loop(); });
+    convert_thread_ = std::thread([this] { _convert_loop(); });
+  }
+
+  void _stop_pipeline() {
+    if (convert_thread_.joinable()) {
+      queue_->close();
+      convert_thread_.join();
+      converted_->close();
+      encode_thread_.join();
+      converted_.reset();
+    }
+    _stop_muxing();
+  }
+
+  // from here on packets go through the mux thread, and audio is encoded on its own if set_audio_thread() asked for it
+  void _start_muxing() {
+    if (mux_thread_.joinable()) return;
+    // compressed packets are small, so the mux stage can stall on slow I/O for a long while before it holds up encoding
+    packets_ = std::make_unique<framer::spsc_ring<AVPacket *>>(1024);
+    if (audio_thread_enabled_ && have_audio && have_video) {
+      audio_packets_ = std::make_unique<framer::spsc_ring<AVPacket *>>(1024);
+      audio_stop_ = false;
+      video_progress_ = video_st.next_pts;
+      audio_thread_ = std::thread([this] { _audio_loop(); });
+    }
+    mux_thread_ = std::thread([this] { _mux_loop(); });
+  }
+
+  // the video must be done, the audio thread catches up with it before it stops
+  void _stop_muxing() {
+    if (audio_thread_.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(audio_mut_);
+        audio_stop_ = true;
+      }
+      audio_cv_.notify_one();
+      audio_thread_.join();
+    }
+    if (!mux_thread_.joinable()) return;
+    packets_->close();
+    mux_thread_.join();
+    // from here on write_frame() muxes directly again
+    packets_.reset();
+    audio_packets_.reset();
+  }
+
+  bool _audio_behind() const {
+    return av_compare_ts(video_progress_, video_st.enc->time_base, audio_st.next_pts, audio_st.enc->time_base) > 0;
+  }
+
+  void _audio_loop() {
+    log_scope scope(this);
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(audio_mut_);
+        audio_cv_.wait(lock, [&] { return audio_stop_ || _audio_behind(); });
+        if (!_audio_behind()) break;  // stopped, and caught up with the video
+      }
+      if (write_audio_frame(oc, &audio_st)) break;
+    }
+    // the mux thread stops waiting for audio packets to compare with
+    audio_packets_->close();
+  }
+
+  void _convert_loop() {
+    log_scope scope(this);
+    queued_frame item;
+    while (queue_->pop_wait(item)) {
+      frame_time_ = item.time;
+      force_keyframe_ = item.keyframe;
+      // the encoder may still reference the previous frames, so convert into one it is done with
+      std::swap(video_st.frame, convert_targets_[next_convert_target_]);
+      next_convert_target_ = (next_convert_target_ + 1) % convert_targets_.size();
+      AVFrame *frame;
+      if (item.buffer) {
+        pixels_ = item.buffer->view(item.layout);
+        frame = av_frame_clone(get_video_frame(&video_st));
+        frame_pool_.release(item.buffer);
+      } else {
+        frame = get_video_frame(&video_st, item.planes);
+        av_frame_free(&item.planes);
+      }
+      if (!frame) {
+        fprintf(stderr, "Could not allocate video frame\n");
+        exit(1);
+      }
+      converted_->push_wait(frame);
+    }
+  }
+
+  void _encode_loop() {
+    log_scope scope(this);
+    AVFrame *frame;
+    while (converted_->pop_wait(frame)) {
+      // same order as _interleave(), but based on the frame's own pts, the convert stage is already ahead
+      while (encode_audio && !audio_thread_.joinable() &&
+             av_compare_ts(frame->pts, video_st.enc->time_base, audio_st.next_pts, audio_st.enc->time_base) > 0) {
+        encode_audio = !write_audio_frame(oc, &audio_st);
+      }
+      if (encode_video) {
+        encode_video = !write_video_frame(oc, &video_st, frame);
+      }
+      av_frame_free(&frame);
+    }
+  }
+
+  /**
+   * Writes the packets of the encode stage, merged in dts order with those of the audio thread if there is one. With
+   * an audio thread, every packet waits until the other stream has one to compare with, or is done.
+   */
+  void _mux_loop() {
+    log_scope scope(this);
+    AVPacket *pkt = nullptr, *audio = nullptr;
+    bool more = true, more_audio = audio_packets_ != nullptr;
+    while (true) {
+      if (!pkt && more) more = packets_->pop_wait(pkt);
+      if (!audio && more_audio) more_audio = audio_packets_->pop_wait(audio);
+      if (!pkt && !audio) break;
+      AVPacket *&next =
+          !audio || (pkt && av_compare_ts(pkt->dts, video_st.st->time_base, audio->dts, audio_st.st->time_base) <= 0)
+              ? pkt
+              : audio;
+      int ret = _mux_packet(next);
+      av_packet_free(&next);
+      if (ret < 0) {
+        fprintf(stderr, "Error while writing output packet: %s\n", av_err2str(ret));
+        exit(1);
+      }
+    }
+  }
+
+  /**
+   * Writes audio frames until the audio stream has caught up with the video stream, then writes one video frame.
+   */
+  template <typename WriteVideo>
+  void _interleave(WriteVideo &&write_video) {
     _configure_streams();
+    log_scope scope(this);
+    frame_time_ = std::chrono::steady_clock::now();
+    if (audio_thread_enabled_ && have_audio && have_video && !mux_thread_.joinable()) _start_muxing();
+    // with an audio thread only the video is written here
+    bool encode_audio = this->encode_audio && !audio_thread_.joinable();
     while (encode_video || encode_audio) {
       if (encode_video &&
           (!encode_audio ||
            av_compare_ts(video_st.next_pts, video_st.enc->time_base, audio_st.next_pts, audio_st.enc->time_base) <=
                0)) {
-        pixels_ = &pixels;
-        encode_video = !write_video_frame(oc, &video_st);
+        encode_video = !write_video();
         break;
       } else if (encode_audio) {
-        encode_audio = !write_audio_frame(oc, &audio_st);
+        this->encode_audio = !write_audio_frame(oc, &audio_st);
+        encode_audio = this->encode_audio;
+      }
+    }
+  }
+
+public:
+  void add_frame(std::vector<uint32_t> &pixels, bool force_keyframe = false) {
+    add_frame(framer::image_view(pixels.data(), width_, height_), force_keyframe);
+  }
+
+  /**
+   * Encodes a packed 32-bit image in place, rows may be padded. The view only needs to stay valid during this call.
+   * With force_keyframe the frame is encoded as an IDR frame, where a segment can start or a seek can land.
+   */
+  void add_frame(const framer::image_view &image, bool force_keyframe = false) {
+    if (image.width != (int)width_ || image.height != (int)height_) {
+      throw std::runtime_error("image dimensions do not match the stream");
+    }
+    if (pass_ == 1) {
+      _first_pass().add_frame(image, force_keyframe);
+      _report_pass_progress();
+      return;
+    }
+    if (queue_) {
+      framer::frame_buffer *buffer = frame_pool_.acquire(width_, height_);
+      for (int y = 0; y < image.height; y++) {
+        memcpy(buffer->row(y), image.row(y), size_t(image.width) * 4);
       }
+      _enqueue({buffer, nullptr, image.layout, std::chrono::steady_clock::now(), force_keyframe});
+      return;
+    }
+    force_keyframe_ = force_keyframe;
+    _interleave([&] {
+      pixels_ = image;
+      return write_video_frame(oc, &video_st);
+    });
+  }
+
+  /**
+   * Encodes a frame that is already in YUV420P or NV12, skipping the color conversion. If the encoder uses the same
+   * layout (see set_pixel_format()) the planes are handed to it without copying.
+   *
+   * Without a release callback the planes only need to stay valid during this call. With one, framer references the
+   * planes until the encoder is done with them and then calls release, so they must stay valid until then.
+   */
+  void add_frame(const framer::yuv_planes &planes,
+                 std::function<void()> release = nullptr,
+                 bool force_keyframe = false) {
+    if (pass_ == 1) {
+      _first_pass().add_frame(planes, std::move(release), force_keyframe);
+      _report_pass_progress();
+      return;
     }
+    _add_planes(planes, std::move(release), std::chrono::steady_clock::now(), force_keyframe);
+  }
+
+  void add_frame(const uint8_t *rawpixels, int width, int height, bool force_keyframe = false) {
+    add_frame(framer::image_view(rawpixels, width, height), force_keyframe);
   }
 
-  void add_frame(const uint8_t *rawpixels, int width, int height) {
-    std::vector<uint32_t> pixels;
-    size_t index = 0;
-    pixels.reserve(width * height);
-    for (unsigned int y = 0; y < (unsigned int)height; y++) {
-      for (unsigned int x = 0; x < (unsigned int)width; x++) {
-        pixels[index++] = *((uint32_t *)rawpixels);
-        rawpixels += sizeof(uint32_t) / sizeof(unsigned char);
+private:
+  friend class abr_streamer;
+
+  // time is when a queued frame counts as added, frames written right away are stamped in _interleave()
+  void _add_planes(const framer::yuv_planes &planes,
+                   std::function<void()> release,
+                   std::chrono::steady_clock::time_point time,
+                   bool force_keyframe = false) {
+    AVFrame *frame = wrap_planes(planes, std::move(release));
+    if (queue_) {
+      if (!frame->buf[0]) {
+        // the planes are only valid during this call, av_frame_ref() copies frames that are not reference counted
+        AVFrame *copy = av_frame_alloc();
+        if (!copy || av_frame_ref(copy, frame) < 0) {
+          fprintf(stderr, "Could not copy video frame\n");
+          exit(1);
+        }
+        av_frame_free(&frame);
+        frame = copy;
       }
+      _enqueue({nullptr, frame, std::nullopt, time, force_keyframe});
+      return;
+    }
+    force_keyframe_ = force_keyframe;
+    _write_planes(frame);
+    av_frame_free(&frame);
+  }
+
+public:
+  /**
+   * Hands out a reusable buffer to render the next frame into, pass it back with submit_frame(). Blocks while all
+   * buffers of the pool are in use (see set_frame_pool_size()).
+   */
+  framer::frame_buffer *acquire_frame() { return frame_pool_.acquire(width_, height_); }
+
+  /**
+   * Encodes a buffer from acquire_frame() and returns it to the pool.
+   */
+  void submit_frame(framer::frame_buffer *buffer, bool force_keyframe = false) {
+    if (queue_ && pass_ != 1) {
+      _enqueue({buffer, nullptr, std::nullopt, std::chrono::steady_clock::now(), force_keyframe});
+      return;
     }
-    add_frame(pixels);
+    auto guard = sg::make_scope_guard([&] { frame_pool_.release(buffer); });
+    add_frame(buffer->view(), force_keyframe);
+  }
+
+  void set_frame_pool_size(size_t size) { frame_pool_.set_capacity(size); }
+
+  size_t frame_pool_high_water_mark() { return frame_pool_.high_water_mark(); }
+
+  /**
+   * Moves color conversion, encoding and muxing to background threads, one per stage, so that add_frame() only has to
+   * queue the frame. Frame N+1 is converted while frame N is encoded, and muxing runs behind a deep packet queue, so
+   * slow disk or network writes don't hold up the encoder. Packed frames are copied into a pool buffer (submit_frame()
+   * avoids that copy), planes without a release callback are copied as well. At most queue_size frames are pending,
+   * when the queue is full the policy decides whether add_frame() waits, or the newest or oldest frame is dropped.
+   * finalize() drains the queue.
+   *
+   * Must be called before the first frame is added.
+   */
+  void set_async(size_t queue_size = 8, framer::backpressure policy = framer::backpressure::BLOCK) {
+    queue_ = std::make_unique<framer::spsc_ring<queued_frame>>(queue_size);
+    backpressure_ = policy;
+    // queued frames, plus the one being converted and the one the caller is filling
+    frame_pool_.set_capacity(queue_size + 2);
   }
 
+  size_t dropped_frames() const { return dropped_frames_; }
+
+  /**
+   * Synthesizes and encodes audio on a thread of its own, which follows the video's progress, instead of between video
+   * frames on the thread that encodes video. A mux thread merges the packets of both in dts order, so the audio
+   * encoder's cost no longer shows up in the time a video frame takes. Works with and without set_async(), must be
+   * called before the first frame.
+   */
+  void set_audio_thread(bool enabled = true) { audio_thread_enabled_ = enabled; }
+
   void run_loop() {
     if (!_is_video_callback_enabled()) {
       throw std::runtime_error("video callback not enabled");
@@ -413,59 +2294,90 @@ public:
     auto stream_start = std::chrono::steady_clock::now();
     const double frame_duration = 1.0 / fps_;  // Duration of one frame in seconds
     int frames = 0;
+    std::vector<uint32_t> pixels(width_ * height_);
     while (running_) {
-      std::vector<uint32_t> pixels(width_ * height_, 0x00000000);
-      while (encode_video || encode_audio) {
-        if (encode_video &&
-            (!encode_audio ||
-             av_compare_ts(video_st.next_pts, video_st.enc->time_base, audio_st.next_pts, audio_st.enc->time_base) <=
-                 0)) {
-          double target_time = frames * frame_duration;
-          // Get actual elapsed time
-          auto now = std::chrono::steady_clock::now();
-          double elapsed = std::chrono::duration<double>(now - stream_start).count();
-          if (elapsed > target_time + frame_duration) {
-            // We're running too slow - skip this frame
-            frames++;
-            continue;
-          }
-          if (elapsed < target_time) {
-            // We're running too fast - sleep until target time
-            std::this_thread::sleep_for(std::chrono::duration<double>(target_time - elapsed));
-          }
-
-          video_callback_(pixels, width_, height_);
-          pixels_ = &pixels;  // TODO: pass it around?
-          encode_video = !write_video_frame(oc, &video_st);
-          frames++;
-          break;
-        } else if (encode_audio) {
-          encode_audio = !write_audio_frame(oc, &audio_st);
-        }
+      double target_time = frames * frame_duration;
+      // Get actual elapsed time
+      auto now = std::chrono::steady_clock::now();
+      double elapsed = std::chrono::duration<double>(now - stream_start).count();
+      if (elapsed > target_time + frame_duration) {
+        // We're running too slow - skip this frame
+        frames++;
+        continue;
       }
+      if (elapsed < target_time) {
+        // We're running too fast - sleep until target time
+        std::this_thread::sleep_for(std::chrono::duration<double>(target_time - elapsed));
+      }
+
+      std::fill(pixels.begin(), pixels.end(), 0x00000000);
+      (*video_callback_)(pixels, width_, height_);
+      add_frame(pixels);  // also catches up on audio first
+      frames++;
     }
   }
 
-  void record() {
+  /**
+   * Records audio only, until stop() or, if duration is positive, until that many seconds of audio are encoded. BATCH
+   * needs a duration unless the callback calls stop(). Returns the audio produced and the CPU time this thread spent on
+   * it, see framer::record_stats.
+   */
+  framer::record_stats record(framer::record_mode mode = framer::record_mode::FREE, double duration = 0) {
     _configure_streams();
-    while (running_) {
-      write_audio_frame(oc, &audio_st);
+    log_scope scope(this);
+    const AVRational time_base = audio_st.enc->time_base;
+    const int64_t start_pts = audio_st.next_pts;
+    const int64_t end_pts = duration > 0 ? start_pts + std::llround(duration / av_q2d(time_base)) : INT64_MAX;
+    const auto wall_start = std::chrono::steady_clock::now();
+    const double cpu_start = framer::thread_cpu_seconds();
+    while (running_ && audio_st.next_pts < end_pts) {
+      if (mode == framer::record_mode::PACED) {
+        // the block starting at next_pts is due once that much time has passed
+        std::chrono::duration<double> due((audio_st.next_pts - start_pts) * av_q2d(time_base));
+        std::this_thread::sleep_until(wall_start +
+                                      std::chrono::duration_cast<std::chrono::steady_clock::duration>(due));
+      }
+      if (write_audio_frame(oc, &audio_st)) break;
     }
+    framer::record_stats stats;
+    stats.audio_seconds = (audio_st.next_pts - start_pts) * av_q2d(time_base);
+    stats.wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+    stats.cpu_seconds = framer::thread_cpu_seconds() - cpu_start;
+    return stats;
   }
   void stop() { running_ = false; }
 
   void finalize() {
     if (!initialized_) return;
 
+    if (pass_ == 1) _second_pass();
+    _stop_pipeline();
+    log_scope scope(this);
+
+    /* Flush the encoders, they may still hold delayed frames. */
+    if (have_video) encode_frame(oc, &video_st, nullptr);
+    if (have_audio && audio_path_ == audio_path::RESAMPLE) _flush_resampler(&audio_st);
+    if (have_audio) encode_frame(oc, &audio_st, nullptr);
+
     /* Write the trailer, if any. The trailer must be written before you
      * close the CodecContexts open when you wrote the header; otherwise
      * av_write_trailer() may try to use memory that was freed on
      * av_codec_close(). */
     av_write_trailer(oc);
 
+    // the contexts are freed below, what they still log goes to this thread's scope
+    unregister_log_contexts();
+
     /* Close each codec. */
     if (have_video) close_stream(oc, &video_st);
     if (have_audio) close_stream(oc, &audio_st);
+    av_audio_fifo_free(audio_fifo_);
+    audio_fifo_ = nullptr;
+    av_frame_free(&resampled_);
+    sws_freeContext(planes_sws_ctx_);
+    planes_sws_ctx_ = nullptr;
+    for (AVFrame *&frame : convert_targets_) av_frame_free(&frame);
+    convert_targets_.clear();
 
     if (!(fmt->flags & AVFMT_NOFILE)) {
       // This ensures all buffers are flushed to disk
@@ -477,52 +2389,53 @@ public:
     /* free the stream */
     avformat_free_context(oc);
     initialized_ = false;
+    if (pass_ != 0) _remove_pass_files();
   }
 
 private:
-  void log_packet(const AVFormatContext *fmt_ctx, const AVPacket *pkt) {
-    AVRational *time_base = &fmt_ctx->streams[pkt->stream_index]->time_base;
-    char buf[512] = {0x00};
-    snprintf(buf,
-             512,
-             "pts:%s pts_time:%s dts:%s dts_time:%s duration:%s duration_time:%s stream_index:%d\n",
-             av_ts2str(pkt->pts),
-             av_ts2timestr(pkt->pts, time_base),
-             av_ts2str(pkt->dts),
-             av_ts2timestr(pkt->dts, time_base),
-             av_ts2str(pkt->duration),
-             av_ts2timestr(pkt->duration, time_base),
-             pkt->stream_index);
-    buf[512 - 1] = 0x00;
-    if (!global_this) {
-      printf("%s", buf);
-      return;
-    }
-    global_this->log_callback_buffer.append(buf);
-    if (global_this->log_callback_buffer[global_this->log_callback_buffer.size() - 1] == '\n') {
-      global_this->log_callback(global_this->log_callback_level, global_this->log_callback_buffer);
-      global_this->log_callback_buffer = "";
-    }
-  }
-
   int write_frame(AVFormatContext *fmt_ctx, const AVRational *time_base, AVStream *st, AVPacket *pkt) {
     /* rescale output packet timestamp values from codec to stream timebase */
     av_packet_rescale_ts(pkt, *time_base, st->time_base);
     pkt->stream_index = st->index;
 
+    if (packets_) {
+      // hand the packet to the mux stage, pkt is reused by the encoder
+      AVPacket *queued = av_packet_alloc();
+      if (!queued) return AVERROR(ENOMEM);
+      av_packet_move_ref(queued, pkt);
+      (audio_packets_ && st == audio_st.st ? audio_packets_ : packets_)->push_wait(queued);
+      return 0;
+    }
+
     /* Write the compressed frame to the media file. */
-    log_packet(fmt_ctx, pkt);
-    return av_interleaved_write_frame(fmt_ctx, pkt);
+    return _mux_packet(pkt);
+  }
+
+  // the source's layout if the encoder supports it, else one with as many channels, so nothing is downmixed silently
+  static const AVChannelLayout *_closest_layout(const AVChannelLayout *supported, const AVChannelLayout &source) {
+    for (int i = 0; supported[i].nb_channels; i++) {
+      if (av_channel_layout_compare(&supported[i], &source) == 0) return &supported[i];
+    }
+    for (int i = 0; supported[i].nb_channels; i++) {
+      if (supported[i].nb_channels == source.nb_channels) return &supported[i];
+    }
+    return &supported[0];
   }
 
   /* Add an output stream. */
-  void add_stream(OutputStream *ost, AVFormatContext *oc, const AVCodec **codec, enum AVCodecID codec_id) {
+  void add_stream(OutputStream *ost,
+                  AVFormatContext *oc,
+                  const AVCodec **codec,
+                  enum AVCodecID codec_id,
+                  const std::string &encoder_name = "") {
     AVCodecContext *c;
 
-    /* find the encoder */
-    *codec = avcodec_find_encoder(codec_id);
+    /* find the encoder, by name if one was chosen */
+    *codec = encoder_name.empty() ? avcodec_find_encoder(codec_id) : avcodec_find_encoder_by_name(encoder_name.c_str());
     if (!(*codec)) {
-      fprintf(stderr, "Could not find encoder for '%s'\n", avcodec_get_name(codec_id));
+      fprintf(stderr,
+              "Could not find encoder for '%s'\n",
+              encoder_name.empty() ? avcodec_get_name(codec_id) : encoder_name.c_str());
       exit(1);
     }
 
@@ -532,6 +2445,11 @@ private:
       exit(1);
     }
     ost->st->id = oc->nb_streams - 1;
+    ost->tmp_pkt = av_packet_alloc();
+    if (!ost->tmp_pkt) {
+      fprintf(stderr, "Could not allocate AVPacket\n");
+      exit(1);
+    }
     c = avcodec_alloc_context3(*codec);
     if (!c) {
       fprintf(stderr, "Could not alloc an encoding context\n");
@@ -546,15 +2464,15 @@ private:
         const enum AVSampleFormat *p = NULL;
         avcodec_get_supported_config(NULL, *codec, AV_CODEC_CONFIG_SAMPLE_FORMAT, 0, (const void **)&p, NULL);
         c->sample_fmt = p ? p[0] : AV_SAMPLE_FMT_FLTP;
-        c->bit_rate = 64000;
-        c->sample_rate = 44100;
 #else
         c->sample_fmt = (*codec)->sample_fmts ? (*codec)->sample_fmts[0] : AV_SAMPLE_FMT_FLTP;
         int i = 0;
 #endif
 
-        c->bit_rate = 64000;
-        c->sample_rate = 44100;
+        // the source's rate and layout if the encoder supports them, so no conversion is needed
+        const int source_rate = audio_options_.sample_rate;
+        c->bit_rate = static_cast<int64_t>(audio_options_.bitrate);
+        c->sample_rate = source_rate;
 #if LIBAVCODEC_VERSION_MAJOR >= 61
         int *supported_samplerates = nullptr;
         avcodec_get_supported_config(
@@ -563,10 +2481,10 @@ private:
         // This is for our custom ffmpeg version build
         if (supported_samplerates) {
           c->sample_rate = supported_samplerates[0];
-          // Look for 44.1kHz specifically
+          // Look for the source rate specifically
           for (int i = 0; supported_samplerates[i]; i++) {
-            if (supported_samplerates[i] == 44100) {
-              c->sample_rate = 44100;
+            if (supported_samplerates[i] == source_rate) {
+              c->sample_rate = source_rate;
               break;
             }
           }
@@ -578,23 +2496,16 @@ private:
         if ((*codec)->supported_samplerates) {
           c->sample_rate = (*codec)->supported_samplerates[0];
           for (i = 0; (*codec)->supported_samplerates[i]; i++) {
-            if ((*codec)->supported_samplerates[i] == 44100) {
-              c->sample_rate = 44100;
+            if ((*codec)->supported_samplerates[i] == source_rate) {
+              c->sample_rate = source_rate;
               break;
             }
           }
         }
 #endif
 
-        // Initialize default stereo layout
-#if LIBAVCODEC_VERSION_MAJOR >= 61
-        if (av_channel_layout_from_mask(&c->ch_layout, AV_CH_LAYOUT_STEREO) < 0) {
-          fprintf(stderr, "Could not set stereo layout\n");
-          exit(1);
-        }
-#else
-        av_channel_layout_default(&c->ch_layout, 2);  // 2 for stereo
-#endif
+        // Initialize the source's layout
+        av_channel_layout_default(&c->ch_layout, audio_options_.channels);
 
 #if LIBAVCODEC_VERSION_MAJOR >= 61
         // Get supported channel layouts
@@ -603,57 +2514,39 @@ private:
             NULL, *codec, AV_CODEC_CONFIG_CHANNEL_LAYOUT, 0, (const void **)&supported_layouts, NULL);
 
         if (supported_layouts) {
-          // Create our desired stereo layout
-          AVChannelLayout stereo_layout = {.order = AV_CHANNEL_ORDER_NATIVE};
-          av_channel_layout_from_mask(&stereo_layout, AV_CH_LAYOUT_STEREO);
-
-          // Look for stereo support in the supported layouts
-          for (int i = 0; supported_layouts[i].nb_channels; i++) {
-            if (av_channel_layout_compare(&supported_layouts[i], &stereo_layout) == 0) {
-              av_channel_layout_copy(&c->ch_layout, &stereo_layout);
-              break;
-            }
+          // Create our desired source layout
+          AVChannelLayout source_layout = {.order = AV_CHANNEL_ORDER_NATIVE};
+          av_channel_layout_default(&source_layout, audio_options_.channels);
 
-            // Store first layout as fallback
-            if (i == 0) {
-              av_channel_layout_copy(&c->ch_layout, &supported_layouts[0]);
-            }
-          }
+          av_channel_layout_copy(&c->ch_layout, _closest_layout(supported_layouts, source_layout));
 
           // Clean up our temporary layout
           // TODO: is this correct, it doesn't crash as with the sample rates
-          av_channel_layout_uninit(&stereo_layout);
+          av_channel_layout_uninit(&source_layout);
           av_free((void *)supported_layouts);
         }
 #else
         // Check codec's supported channel layouts
         if ((*codec)->ch_layouts) {
-          AVChannelLayout stereo_layout = {.order = AV_CHANNEL_ORDER_NATIVE};
-          av_channel_layout_from_mask(&stereo_layout, AV_CH_LAYOUT_STEREO);
-
-          for (i = 0; (*codec)->ch_layouts[i].nb_channels; i++) {
-            if (av_channel_layout_compare(&(*codec)->ch_layouts[i], &stereo_layout) == 0) {
-              av_channel_layout_copy(&c->ch_layout, &stereo_layout);
-              break;
-            }
+          AVChannelLayout source_layout = {.order = AV_CHANNEL_ORDER_NATIVE};
+          av_channel_layout_default(&source_layout, audio_options_.channels);
 
-            if (i == 0) {
-              av_channel_layout_copy(&c->ch_layout, &(*codec)->ch_layouts[0]);
-            }
-          }
+          av_channel_layout_copy(&c->ch_layout, _closest_layout((*codec)->ch_layouts, source_layout));
+          av_channel_layout_uninit(&source_layout);
         }
 #endif
 
-        ost->st->time_base = AVRational{1, audio_st.enc->sample_rate};  // Usually 1/44100
+        ost->st->time_base = AVRational{1, audio_st.enc->sample_rate};  // Usually the source rate
         c->time_base = ost->st->time_base;
 
-        if (num_threads_ != -1) {
-          c->thread_count = num_threads_;
+        // audio encoders hardly thread, so auto is a single thread
+        if (threading_.audio_threads != -1) {
+          c->thread_count = threading_.audio_threads == 0 ? 1 : threading_.audio_threads;
         }
         break;
       }
       case AVMEDIA_TYPE_VIDEO:
-        c->codec_id = codec_id;
+        c->codec_id = (*codec)->id;
         c->bit_rate = bitrate_;
 
         // cranking up resolution can bump the profile level to:
@@ -674,19 +2567,19 @@ private:
 
         // more info about profiles and levels here:
         //  https://sonnati.wordpress.com/2008/10/25/a-primer-to-h-264-levels-and-profiles/
-        c->profile = FF_PROFILE_H264_BASELINE;
-        c->profile = FF_PROFILE_H264_MAIN;
-        c->profile = FF_PROFILE_H264_HIGH;
-        // c->profile = FF_PROFILE_H264_HIGH_444_PREDICTIVE;
-
-        // laptop supports streaming up to profile level 5.2. in the browser
-        // we should make this and the profile configurable.
-        c->level = 52;
-
-        if (num_threads_ != -1) {
-          c->thread_count = num_threads_;
+        // both can be overridden with set_encoder_options()
+        if (c->codec_id == AV_CODEC_ID_H264) {
+          c->profile = FF_PROFILE_H264_BASELINE;
+          c->profile = FF_PROFILE_H264_MAIN;
+          c->profile = FF_PROFILE_H264_HIGH;
+          // c->profile = FF_PROFILE_H264_HIGH_444_PREDICTIVE;
+
+          // laptop supports streaming up to profile level 5.2. in the browser
+          c->level = 52;
         }
 
+        _configure_video_threads(c);
+
         /* Resolution must be a multiple of two. */
         c->width = width_;
         c->height = height_;
@@ -704,6 +2597,26 @@ private:
 
         c->gop_size = 12; /* emit one intra frame every twelve frames at most */
         c->pix_fmt = STREAM_PIX_FMT;
+
+        /* tag the stream with the matrix used by fill_yuv_image() */
+        switch (cspace_) {
+          case color_space::BT709:
+            c->colorspace = AVCOL_SPC_BT709;
+            c->color_primaries = AVCOL_PRI_BT709;
+            c->color_trc = AVCOL_TRC_BT709;
+            break;
+          case color_space::BT2020:
+            c->colorspace = AVCOL_SPC_BT2020_NCL;
+            c->color_primaries = AVCOL_PRI_BT2020;
+            c->color_trc = AVCOL_TRC_BT2020_10;
+            break;
+          default:
+            c->colorspace = AVCOL_SPC_SMPTE170M;
+            c->color_primaries = AVCOL_PRI_SMPTE170M;
+            c->color_trc = AVCOL_TRC_SMPTE170M;
+            break;
+        }
+        c->color_range = crange_ == color_range::FULL ? AVCOL_RANGE_JPEG : AVCOL_RANGE_MPEG;
         if (c->codec_id == AV_CODEC_ID_MPEG2VIDEO) {
           /* just for testing, we also add B-frames */
           c->max_b_frames = 2;
@@ -785,10 +2698,37 @@ private:
 
     ost->frame = alloc_audio_frame(c->sample_fmt, &c->ch_layout, c->sample_rate, nb_samples);
 
-    AVChannelLayout tmp_layout;
-    av_channel_layout_copy(&tmp_layout, &c->ch_layout);
+    AVSampleFormat in_sample_fmt = AV_SAMPLE_FMT_S16;
+    if (audio_ring_) {
+      in_sample_fmt = AV_SAMPLE_FMT_FLT;
+    } else if (audio_float_callback_) {
+      in_sample_fmt = audio_float_layout_ == framer::sample_layout::PLANAR ? AV_SAMPLE_FMT_FLTP : AV_SAMPLE_FMT_FLT;
+    }
+    // the encoder falls back to another rate or layout if it doesn't support the source's
+    const int in_sample_rate = audio_options_.sample_rate;
+    AVChannelLayout in_layout;
+    av_channel_layout_default(&in_layout, audio_options_.channels);
+    auto in_layout_guard = sg::make_scope_guard([&] { av_channel_layout_uninit(&in_layout); });
+    const bool same_layout = av_channel_layout_compare(&in_layout, &c->ch_layout) == 0;
+
+    if (in_sample_rate != c->sample_rate) {
+      audio_path_ = audio_path::RESAMPLE;
+    } else if (!same_layout) {
+      audio_path_ = audio_path::CONVERT;
+    } else if (in_sample_fmt == c->sample_fmt) {
+      audio_path_ = audio_path::DIRECT;
+    } else if (in_sample_fmt == AV_SAMPLE_FMT_FLT && c->sample_fmt == AV_SAMPLE_FMT_FLTP) {
+      audio_path_ = audio_path::DEINTERLEAVE;
+    } else {
+      audio_path_ = audio_path::CONVERT;
+    }
 
-    ost->tmp_frame = alloc_audio_frame(AV_SAMPLE_FMT_S16, &tmp_layout, c->sample_rate, nb_samples);
+    ost->tmp_frame = nullptr;
+    if (audio_path_ != audio_path::DIRECT) {
+      // when resampling, blocks of about the same duration as an encoder frame
+      const int in_nb_samples = static_cast<int>(av_rescale(nb_samples, in_sample_rate, c->sample_rate));
+      ost->tmp_frame = alloc_audio_frame(in_sample_fmt, &in_layout, in_sample_rate, in_nb_samples);
+    }
 
     /* copy the stream parameters to the muxer */
     ret = avcodec_parameters_from_context(ost->st->codecpar, c);
@@ -797,6 +2737,8 @@ private:
       exit(1);
     }
 
+    if (audio_path_ != audio_path::CONVERT && audio_path_ != audio_path::RESAMPLE) return;
+
     /* create resampler context */
     ost->swr_ctx = swr_alloc();
     if (!ost->swr_ctx) {
@@ -805,38 +2747,34 @@ private:
     }
 
     /* set options */
-    av_opt_set_chlayout(ost->swr_ctx, "in_chlayout", &c->ch_layout, 0);
+    av_opt_set_chlayout(ost->swr_ctx, "in_chlayout", &in_layout, 0);
     av_opt_set_chlayout(ost->swr_ctx, "out_chlayout", &c->ch_layout, 0);
-    av_opt_set_int(ost->swr_ctx, "in_sample_rate", c->sample_rate, 0);
-    av_opt_set_sample_fmt(ost->swr_ctx, "in_sample_fmt", AV_SAMPLE_FMT_S16, 0);
+    av_opt_set_int(ost->swr_ctx, "in_sample_rate", in_sample_rate, 0);
+    av_opt_set_sample_fmt(ost->swr_ctx, "in_sample_fmt", in_sample_fmt, 0);
     av_opt_set_int(ost->swr_ctx, "out_sample_rate", c->sample_rate, 0);
     av_opt_set_sample_fmt(ost->swr_ctx, "out_sample_fmt", c->sample_fmt, 0);
+    _set_resampler_quality(ost->swr_ctx);
 
     /* initialize the resampling context */
     if ((ret = swr_init(ost->swr_ctx)) < 0) {
-      fprintf(stderr, "Failed to initialize the resampling context\n");
+      fprintf(stderr, "Failed to initialize the resampling context (soxr needs FFmpeg built with libsoxr)\n");
       exit(1);
     }
-  }
-
-  AVFrame *get_audio_frame(OutputStream *ost) {
-    AVFrame *frame = ost->tmp_frame;
-    int16_t *q = (int16_t *)frame->data[0];  // I don't know why but passing this pointer to the callback doesn't work
-    int16_t *tmp = (int16_t *)av_malloc(ost->enc->ch_layout.nb_channels * sizeof(int16_t));
-    memset(tmp, 0, ost->enc->ch_layout.nb_channels * sizeof(int16_t));
 
-    for (int j = 0; j < frame->nb_samples; j++) {
-      float t = float(ost->next_pts + j) / ost->enc->sample_rate;
-      float seconds = t;
-
-      if (audio_callback_) {
-        audio_callback_(seconds, fps_, ost->enc->ch_layout.nb_channels, tmp);
-      }
-
-      for (int i = 0; i < ost->enc->ch_layout.nb_channels; i++) {
-        *q++ = static_cast<int16_t>(tmp[i]);
+    if (audio_path_ == audio_path::RESAMPLE) {
+      audio_fifo_ = av_audio_fifo_alloc(c->sample_fmt, c->ch_layout.nb_channels, nb_samples);
+      if (!audio_fifo_) {
+        fprintf(stderr, "Could not allocate the audio FIFO\n");
+        exit(1);
       }
     }
+  }
+
+  AVFrame *get_audio_frame(OutputStream *ost) {
+    // without a conversion the samples go straight into the encoder's frame
+    AVFrame *frame = audio_path_ == audio_path::DIRECT ? ost->frame : ost->tmp_frame;
+    if (frame == ost->frame && av_frame_make_writable(frame) < 0) exit(1);
+    _fill_audio(frame, ost->next_pts);  // same rate as the encoder
     if (mode_ == stream_mode::HLS) {
       auto now = std::chrono::steady_clock::now();
       auto duration = std::chrono::duration_cast<std::chrono::microseconds>(now - start_time_);
@@ -852,8 +2790,157 @@ private:
       ost->next_pts += frame->nb_samples;
     }
 
-    av_free(tmp);
-    return frame;
+    return frame;
+  }
+
+  void _set_resampler_quality(SwrContext *swr) {
+    if (audio_options_.resampler == framer::resampler::SOXR) {
+      av_opt_set(swr, "resampler", "soxr", 0);
+      av_opt_set_int(swr, "precision", audio_options_.soxr_precision, 0);
+    } else {
+      av_opt_set_int(swr, "filter_size", audio_options_.filter_size, 0);
+    }
+  }
+
+  // the converter from what add_audio_samples() gets to the source format, rebuilt when the input changes
+  void _configure_ingest(framer::sample_format format, int sample_rate, int channels) {
+    if (ingest_swr_ && format == ingest_format_ && sample_rate == ingest_rate_ && channels == ingest_channels_) return;
+    swr_free(&ingest_swr_);
+    ingest_swr_ = swr_alloc();
+    if (!ingest_swr_) {
+      fprintf(stderr, "Could not allocate resampler context\n");
+      exit(1);
+    }
+    AVChannelLayout in_layout, out_layout;
+    av_channel_layout_default(&in_layout, channels);
+    av_channel_layout_default(&out_layout, audio_options_.channels);
+    av_opt_set_chlayout(ingest_swr_, "in_chlayout", &in_layout, 0);
+    av_opt_set_chlayout(ingest_swr_, "out_chlayout", &out_layout, 0);
+    av_opt_set_int(ingest_swr_, "in_sample_rate", sample_rate, 0);
+    av_opt_set_sample_fmt(ingest_swr_,
+                          "in_sample_fmt",
+                          format == framer::sample_format::FLT ? AV_SAMPLE_FMT_FLT : AV_SAMPLE_FMT_S16,
+                          0);
+    av_opt_set_int(ingest_swr_, "out_sample_rate", audio_options_.sample_rate, 0);
+    av_opt_set_sample_fmt(ingest_swr_, "out_sample_fmt", AV_SAMPLE_FMT_FLT, 0);
+    _set_resampler_quality(ingest_swr_);
+    av_channel_layout_uninit(&in_layout);
+    av_channel_layout_uninit(&out_layout);
+    if (swr_init(ingest_swr_) < 0) {
+      fprintf(stderr, "Failed to initialize the resampling context\n");
+      exit(1);
+    }
+    ingest_format_ = format;
+    ingest_rate_ = sample_rate;
+    ingest_channels_ = channels;
+  }
+
+  // fills frame with the source's samples from sample number start on
+  void _fill_audio(AVFrame *frame, int64_t start) {
+    const int sample_rate = frame->sample_rate;
+    const int num_channels = frame->ch_layout.nb_channels;
+    const double start_seconds = double(start) / sample_rate;
+    int16_t *samples = (int16_t *)frame->data[0];  // interleaved S16 unless there is a float callback, see open_audio()
+
+    if (audio_ring_) {
+      // interleaved float, see open_audio()
+      float *dst = reinterpret_cast<float *>(frame->data[0]);
+      const size_t count = size_t(frame->nb_samples) * num_channels;
+      if (audio_owed_ > 0) {
+        const size_t skipped = audio_ring_->skip(audio_owed_ * num_channels) / num_channels;
+        audio_owed_ -= skipped;
+        dropped_audio_samples_ += skipped;
+      }
+      const size_t got = audio_ring_->read(dst, count);
+      if (got < count) {
+        std::fill(dst + got, dst + count, 0.0f);
+        audio_underrun_samples_ += (count - got) / num_channels;
+        audio_owed_ += (count - got) / num_channels;
+      }
+    } else if (audio_float_callback_) {
+      float *const *channels = reinterpret_cast<float *const *>(frame->extended_data);
+      audio_float_callback_(start_seconds, sample_rate, num_channels, frame->nb_samples, channels);
+    } else if (audio_block_callback_) {
+      audio_block_callback_(start_seconds, sample_rate, num_channels, frame->nb_samples, samples);
+    } else if (audio_callback_) {
+      _fill_samples_per_sample(start, sample_rate, num_channels, frame->nb_samples, samples);
+    }
+  }
+
+  /**
+   * Resamples source blocks into the FIFO until it holds an encoder frame, and returns that frame. The number of
+   * samples that come out of a block varies with the rate conversion.
+   */
+  AVFrame *_resample_audio_frame(OutputStream *ost) {
+    AVCodecContext *c = ost->enc;
+    AVFrame *in = ost->tmp_frame;
+    while (av_audio_fifo_size(audio_fifo_) < ost->frame->nb_samples) {
+      _fill_audio(in, source_samples_);
+      source_samples_ += in->nb_samples;
+      const int capacity = swr_get_out_samples(ost->swr_ctx, in->nb_samples);
+      if (!resampled_ || resampled_->nb_samples < capacity) {
+        av_frame_free(&resampled_);
+        resampled_ = alloc_audio_frame(c->sample_fmt, &c->ch_layout, c->sample_rate, capacity);
+      }
+      const int converted = swr_convert(
+          ost->swr_ctx, resampled_->extended_data, capacity, (const uint8_t **)in->extended_data, in->nb_samples);
+      if (converted < 0) {
+        fprintf(stderr, "Error while resampling\n");
+        exit(1);
+      }
+      if (av_audio_fifo_write(audio_fifo_, (void **)resampled_->extended_data, converted) < converted) {
+        fprintf(stderr, "Could not grow the audio FIFO\n");
+        exit(1);
+      }
+    }
+    if (av_frame_make_writable(ost->frame) < 0) exit(1);
+    av_audio_fifo_read(audio_fifo_, (void **)ost->frame->extended_data, ost->frame->nb_samples);
+    return ost->frame;
+  }
+
+  // encodes what swresample delayed and what is left in the FIFO as a last, shorter frame
+  void _flush_resampler(OutputStream *ost) {
+    AVCodecContext *c = ost->enc;
+    const int capacity = swr_get_out_samples(ost->swr_ctx, 0);
+    if (capacity > 0) {
+      if (!resampled_ || resampled_->nb_samples < capacity) {
+        av_frame_free(&resampled_);
+        resampled_ = alloc_audio_frame(c->sample_fmt, &c->ch_layout, c->sample_rate, capacity);
+      }
+      const int converted = swr_convert(ost->swr_ctx, resampled_->extended_data, capacity, nullptr, 0);
+      if (converted < 0) {
+        fprintf(stderr, "Error while flushing the resampler\n");
+        exit(1);
+      }
+      if (av_audio_fifo_write(audio_fifo_, (void **)resampled_->extended_data, converted) < converted) {
+        fprintf(stderr, "Could not grow the audio FIFO\n");
+        exit(1);
+      }
+    }
+    // full frames first, in case the encoder didn't ask for audio again after the video ended
+    while (av_audio_fifo_size(audio_fifo_) > 0) {
+      if (av_frame_make_writable(ost->frame) < 0) exit(1);
+      const int remaining = std::min(av_audio_fifo_size(audio_fifo_), ost->frame->nb_samples);
+      av_audio_fifo_read(audio_fifo_, (void **)ost->frame->extended_data, remaining);
+      // encoders accept a short frame at the end, it is the last one sent before the flush
+      ost->frame->nb_samples = remaining;
+      ost->frame->pts = audio_pts;
+      audio_pts += remaining;
+      audio_st.next_pts = audio_pts;
+      ost->samples_count += remaining;
+      encode_frame(oc, ost, ost->frame);
+    }
+  }
+
+  // the per-sample callback as a block source, channels it leaves alone keep their previous value within the frame
+  void _fill_samples_per_sample(int64_t start, int sample_rate, int num_channels, int nb_samples, int16_t *samples) {
+    audio_scratch_.assign(num_channels, 0);
+    for (int j = 0; j < nb_samples; j++) {
+      const float seconds = float(start + j) / sample_rate;
+      (*audio_callback_)(seconds, fps_, num_channels, audio_scratch_.data());
+      std::copy(audio_scratch_.begin(), audio_scratch_.end(), samples);
+      samples += num_channels;
+    }
   }
 
   /*
@@ -864,43 +2951,47 @@ private:
     AVCodecContext *c;
     AVFrame *frame;
     int ret;
-    int got_packet;
     int64_t dst_nb_samples;
 
-    AVPacket *pkt = av_packet_alloc();
-    if (!pkt) {
-      printf("av_packet_alloc failed\n");
-      return AVERROR(ENOMEM);
-    }
-    auto guard = sg::make_scope_guard([&] { av_packet_free(&pkt); });
-
     c = ost->enc;
 
-    frame = get_audio_frame(ost);
+    frame = audio_path_ == audio_path::RESAMPLE ? _resample_audio_frame(ost) : get_audio_frame(ost);
 
     if (frame) {
-      /* convert samples from native format to destination codec format, using the resampler */
-      /* compute destination number of samples */
-      dst_nb_samples = av_rescale_rnd(
-          swr_get_delay(ost->swr_ctx, c->sample_rate) + frame->nb_samples, c->sample_rate, c->sample_rate, AV_ROUND_UP);
-      av_assert0(dst_nb_samples == frame->nb_samples);
-
-      /* when we pass a frame to the encoder, it may keep a reference to it
-       * internally;
-       * make sure we do not overwrite it here
-       */
-      ret = av_frame_make_writable(ost->frame);
-      if (ret < 0) exit(1);
-
-      /* convert to destination format */
-      ret = swr_convert(ost->swr_ctx,
-                        ost->frame->data,
-                        static_cast<int>(dst_nb_samples),
-                        (const uint8_t **)frame->data,
-                        frame->nb_samples);
-      if (ret < 0) {
-        fprintf(stderr, "Error while converting\n");
-        exit(1);
+      dst_nb_samples = frame->nb_samples;
+      if (audio_path_ == audio_path::CONVERT || audio_path_ == audio_path::DEINTERLEAVE) {
+        /* when we pass a frame to the encoder, it may keep a reference to it
+         * internally;
+         * make sure we do not overwrite it here
+         */
+        ret = av_frame_make_writable(ost->frame);
+        if (ret < 0) exit(1);
+      }
+
+      if (audio_path_ == audio_path::DEINTERLEAVE) {
+        pcm::deinterleave(reinterpret_cast<const float *>(frame->data[0]),
+                          reinterpret_cast<float *const *>(ost->frame->extended_data),
+                          c->ch_layout.nb_channels,
+                          frame->nb_samples);
+      } else if (audio_path_ == audio_path::CONVERT) {
+        /* convert samples from native format to destination codec format, using the resampler */
+        /* compute destination number of samples */
+        dst_nb_samples = av_rescale_rnd(swr_get_delay(ost->swr_ctx, c->sample_rate) + frame->nb_samples,
+                                        c->sample_rate,
+                                        c->sample_rate,
+                                        AV_ROUND_UP);
+        av_assert0(dst_nb_samples == frame->nb_samples);
+
+        /* convert to destination format */
+        ret = swr_convert(ost->swr_ctx,
+                          ost->frame->data,
+                          static_cast<int>(dst_nb_samples),
+                          (const uint8_t **)frame->data,
+                          frame->nb_samples);
+        if (ret < 0) {
+          fprintf(stderr, "Error while converting\n");
+          exit(1);
+        }
       }
       frame = ost->frame;
 
@@ -911,35 +3002,7 @@ private:
       ost->samples_count += dst_nb_samples;
     }
 
-    ret = avcodec_send_frame(c, frame);
-    if (ret < 0) {
-      return ret;
-    }
-
-    ret = avcodec_receive_packet(c, pkt);
-    if (ret >= 0) {
-      got_packet = 1;
-    } else if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-      got_packet = 0;
-      ret = 0;
-    } else {
-      return ret;
-    }
-
-    if (ret < 0) {
-      fprintf(stderr, "Error encoding audio frame: %s\n", av_err2str(ret));
-      exit(1);
-    }
-
-    if (got_packet) {
-      ret = write_frame(oc, &c->time_base, ost->st, pkt);
-      if (ret < 0) {
-        fprintf(stderr, "Error while writing audio frame: %s\n", av_err2str(ret));
-        exit(1);
-      }
-    }
-
-    return (frame || got_packet) ? 0 : 1;
+    return encode_frame(oc, ost, frame);
   }
 
   /**************************************************************/
@@ -966,15 +3029,114 @@ private:
     return picture;
   }
 
+  void _configure_video_threads(AVCodecContext *c) {
+    if (threading_.video_threads == 0) {
+      const int cores = static_cast<int>(std::max(std::thread::hardware_concurrency(), 1u));
+      // about one thread per 256x256 pixels, small frames can't keep more busy
+      const int by_size = std::max(1, static_cast<int>(width_ * height_ / (256 * 256)));
+      c->thread_count = std::min(cores, by_size);
+    } else if (threading_.video_threads != -1) {
+      c->thread_count = threading_.video_threads;
+    }
+
+    framer::thread_type type = threading_.video_thread_type;
+    if (type == framer::thread_type::AUTO && latency_mode_ == framer::latency_mode::LOW) {
+      type = framer::thread_type::SLICE;
+    }
+    if (type == framer::thread_type::FRAME) c->thread_type = FF_THREAD_FRAME;
+    if (type == framer::thread_type::SLICE) c->thread_type = FF_THREAD_SLICE;
+  }
+
+  static framer::thread_info _threading(const AVCodecContext *c) {
+    if (!c) return {0, framer::thread_type::AUTO, false};
+    const int active = c->active_thread_type;
+    const bool internal = !active && c->codec && (c->codec->capabilities & AV_CODEC_CAP_OTHER_THREADS);
+    if (!active && !internal) return {1, framer::thread_type::AUTO, false};  // single-threaded, like the native AAC
+    const int type = active ? active : c->thread_type;
+    return {c->thread_count,
+            type == FF_THREAD_SLICE ? framer::thread_type::SLICE
+            : type == FF_THREAD_FRAME ? framer::thread_type::FRAME
+                                      : framer::thread_type::AUTO,
+            internal};
+  }
+
+  void apply_encoder_options(AVCodecContext *c, AVDictionary **opt) {
+    const framer::encoder_options &options = encoder_options_;
+    auto has_option = [&](const char *name) { return c->priv_data && av_opt_find(c->priv_data, name, nullptr, 0, 0); };
+    if (!options.preset.empty()) av_dict_set(opt, "preset", options.preset.c_str(), 0);
+    if (!options.tune.empty()) av_dict_set(opt, "tune", options.tune.c_str(), 0);
+    if (!options.profile.empty()) {
+      c->profile = FF_PROFILE_UNKNOWN;
+      // x264 and x265 take the profile name in a private option, the context's own "profile" is numeric
+      if (c->priv_data && av_opt_find(c->priv_data, "profile", nullptr, 0, 0)) {
+        av_opt_set(c->priv_data, "profile", options.profile.c_str(), 0);
+      } else {
+        av_dict_set(opt, "profile", options.profile.c_str(), 0);
+      }
+    }
+    if (options.level >= 0) c->level = options.level;
+    if (options.gop_size >= 0) c->gop_size = options.gop_size;
+    if (options.max_b_frames >= 0) c->max_b_frames = options.max_b_frames;
+
+    if (options.rc != framer::rate_control::BITRATE) {
+      const char *name = options.rc == framer::rate_control::CRF ? "crf" : "qp";
+      c->bit_rate = 0;  // constant quality, libvpx only does that without a target bitrate
+      if (c->priv_data && av_opt_find(c->priv_data, name, nullptr, 0, 0)) {
+        char value[32];
+        snprintf(value, sizeof(value), "%g", options.quality);
+        av_dict_set(opt, name, value, 0);
+      } else {
+        c->flags |= AV_CODEC_FLAG_QSCALE;
+        c->global_quality = static_cast<int>(FF_QP2LAMBDA * options.quality);
+      }
+    }
+
+    if (latency_mode_ == framer::latency_mode::LOW) {
+      if (options.tune.empty() && has_option("tune")) av_dict_set(opt, "tune", "zerolatency", 0);
+      if (has_option("lag-in-frames")) av_dict_set(opt, "lag-in-frames", "0", 0);  // libvpx
+      if (has_option("deadline")) av_dict_set(opt, "deadline", "realtime", 0);
+      if (intra_refresh_ && has_option("intra-refresh")) av_dict_set(opt, "intra-refresh", "1", 0);
+      c->max_b_frames = 0;
+    }
+
+    // forced keyframes are IDR frames, so that a segment or a seek can start there
+    if (has_option("forced-idr")) av_dict_set(opt, "forced-idr", "1", 0);
+
+    if (analysis_ || pass_ == 2) {
+      c->flags |= analysis_ ? AV_CODEC_FLAG_PASS1 : AV_CODEC_FLAG_PASS2;
+      // x264 keeps the statistics in a file of its own (and runs a fast first pass by itself), other encoders pass them
+      // through stats_out and stats_in
+      if (has_option("stats")) {
+        av_dict_set(opt, "stats", _pass_file(".stats").c_str(), 0);
+      } else if (pass_ == 2) {
+        if (stats_.empty()) {
+          fprintf(stderr, "The first pass of %s left no statistics for the second pass\n", filename_.c_str());
+          exit(1);
+        }
+        c->stats_in = av_strdup(stats_.c_str());
+      }
+    }
+
+    for (const auto &option : options.private_options) {
+      av_dict_set(opt, option.first.c_str(), option.second.c_str(), 0);
+    }
+  }
+
   void open_video(AVFormatContext *oc, const AVCodec *codec, OutputStream *ost, AVDictionary *opt_arg) {
     int ret;
     AVCodecContext *c = ost->enc;
     AVDictionary *opt = nullptr;
 
     av_dict_copy(&opt, opt_arg, 0);
+    apply_encoder_options(c, &opt);
 
     /* open the codec */
     ret = avcodec_open2(c, codec, &opt);
+    // avcodec_open2() leaves the options it did not use in the dictionary
+    const AVDictionaryEntry *unused = nullptr;
+    while ((unused = av_dict_get(opt, "", unused, AV_DICT_IGNORE_SUFFIX))) {
+      fprintf(stderr, "Encoder %s does not support option '%s'\n", codec->name, unused->key);
+    }
     av_dict_free(&opt);
     if (ret < 0) {
       fprintf(stderr, "Could not open video codec: %s\n", av_err2str(ret));
@@ -1012,40 +3174,11 @@ private:
     int ret = av_frame_make_writable(pict);
     if (ret < 0) exit(1);
 
-    size_t index = 0;
-    for (int y = 0; y < height; y++) {
-      for (int x = 0; x < width; x++) {
-        uint32_t &pixel((*pixels_)[index++]);
-
-        uint8_t R, G, B;
-        switch (cmode) {
-          case color_mode::RGBA:
-            // used by SFML
-            R = (pixel & 0x000000FF) >> 0;
-            G = (pixel & 0x0000FF00) >> 8;
-            B = (pixel & 0x00FF0000) >> 16;
-            // A = (pixel & 0xFF000000) >> 24;
-            break;
-          case color_mode::BGRA:
-            // Used by Allegro 5
-            B = (pixel & 0x000000FF) >> 0;
-            G = (pixel & 0x0000FF00) >> 8;
-            R = (pixel & 0x00FF0000) >> 16;
-            // A = (pixel & 0xFF000000) >> 24;
-            break;
-        }
-        // convert RGBA -> CMYK
-        uint8_t Y = static_cast<uint8_t>((0.257 * R) + (0.504 * G) + (0.098 * B) + 16);
-        uint8_t Cb = static_cast<uint8_t>((-0.148 * R) - (0.291 * G) + (0.439 * B) + 128);
-        uint8_t Cr = static_cast<uint8_t>((0.439 * R) - (0.368 * G) - (0.071 * B) + 128);
-
-        pict->data[0][y * pict->linesize[0] + x] = Y;
-        if ((y % 2) == 0 && (x % 2) == 0) {
-          pict->data[1][(y / 2) * pict->linesize[1] + (x / 2)] = Cb;
-          pict->data[2][(y / 2) * pict->linesize[2] + (x / 2)] = Cr;
-        }
-      }
-    }
+    // the channel order only changes the coefficients, see yuv::coefficients
+    const yuv::coefficients &k = _coefficients(pixels_.layout ? *pixels_.layout : cmode);
+    const int hardware_threads = static_cast<int>(std::max(std::thread::hardware_concurrency(), 1u));
+    convert_pool_.resize(num_threads_ == -1 ? hardware_threads : num_threads_);
+    framer::convert_to_yuv420p(pixels_, k, pict->data, pict->linesize, convert_pool_);
   }
 
   AVFrame *get_video_frame(OutputStream *ost) {
@@ -1075,7 +3208,7 @@ private:
           exit(1);
         }
       }
-      fill_yuv_image(cmode_, ost->tmp_frame, static_cast<int>(ost->next_pts), c->width, c->height);
+      fill_yuv_image(_color_mode(), ost->tmp_frame, static_cast<int>(ost->next_pts), c->width, c->height);
       sws_scale(ost->sws_ctx,
                 (const uint8_t *const *)ost->tmp_frame->data,
                 ost->tmp_frame->linesize,
@@ -1084,22 +3217,154 @@ private:
                 ost->frame->data,
                 ost->frame->linesize);
     } else {
-      fill_yuv_image(cmode_, ost->frame, static_cast<int>(ost->next_pts), c->width, c->height);
+      fill_yuv_image(_color_mode(), ost->frame, static_cast<int>(ost->next_pts), c->width, c->height);
     }
+    set_video_pts(ost, ost->frame);
+    return ost->frame;
+  }
+
+  void set_video_pts(OutputStream *ost, AVFrame *frame) {
     if (mode_ == stream_mode::HLS) {
-      auto now = std::chrono::steady_clock::now();
-      auto duration = std::chrono::duration_cast<std::chrono::microseconds>(now - start_time_);
-      ost->frame->pts = av_rescale_q(duration.count(),
-                                     AVRational{1, 1000000},  // microseconds
-                                     c->time_base);
-      video_st.next_pts = ost->frame->pts + 1;
+      // stamped with the time the frame was added, in async mode it reaches the encoder later
+      auto duration = std::chrono::duration_cast<std::chrono::microseconds>(frame_time_ - start_time_);
+      frame->pts = av_rescale_q(duration.count(),
+                                AVRational{1, 1000000},  // microseconds
+                                ost->enc->time_base);
+      video_st.next_pts = frame->pts + 1;
 
     } else {
-      ost->frame->pts = video_pts;
+      frame->pts = video_pts;
       video_pts += av_rescale_q(1, AVRational{1, (int)fps_}, video_st.enc->time_base);
       video_st.next_pts = video_pts;
     }
-    return ost->frame;
+    if (audio_thread_.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(audio_mut_);
+        video_progress_ = video_st.next_pts;
+      }
+      audio_cv_.notify_one();
+    }
+    bool keyframe = force_keyframe_;
+    force_keyframe_ = false;
+    if (scene_detector_.threshold > 0 &&
+        scene_detector_.cut(frame->data[0], frame->linesize[0], frame->width, frame->height, fps_)) {
+      keyframe = true;
+    }
+    // ost->frame is reused, so the type is always set
+    frame->pict_type = keyframe ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+    if (keyframe && analysis_) spooled_keyframes_.push_back(spooled_frames_);
+
+    if (latency_callback_) {
+      std::lock_guard<std::mutex> lock(latency_mut_);
+      // frames the encoder never returns a packet for would pile up otherwise
+      if (latency_marks_.size() >= 256) latency_marks_.pop_front();
+      latency_marks_.emplace_back(av_rescale_q(frame->pts, ost->enc->time_base, ost->st->time_base), frame_time_);
+    }
+  }
+
+  void _report_latency(int64_t pts) {
+    std::chrono::steady_clock::time_point added;
+    {
+      std::lock_guard<std::mutex> lock(latency_mut_);
+      auto it = std::find_if(latency_marks_.begin(), latency_marks_.end(), [&](const auto &mark) {
+        return mark.first == pts;
+      });
+      if (it == latency_marks_.end()) return;
+      added = it->second;
+      latency_marks_.erase(it);
+    }
+    latency_callback_(
+        pts, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - added));
+  }
+
+  int _mux_packet(AVPacket *pkt) {
+    log_packet(oc, pkt);
+    const bool report = latency_callback_ && have_video && pkt->stream_index == video_st.st->index;
+    const int64_t pts = pkt->pts;
+    int ret = av_interleaved_write_frame(oc, pkt);
+    if (ret >= 0 && report) _report_latency(pts);
+    return ret;
+  }
+
+  /**
+   * Wraps caller-owned planes in an AVFrame without copying. With a release callback the planes are reference counted
+   * through an AVBufferRef, so the encoder can hold on to them, and release is called once it lets go. Without one the
+   * frame is not reference counted, and libavcodec copies the planes when the frame is sent.
+   */
+  AVFrame *wrap_planes(const framer::yuv_planes &planes, std::function<void()> release) {
+    AVFrame *frame = av_frame_alloc();
+    if (!frame) {
+      fprintf(stderr, "Could not allocate video frame\n");
+      exit(1);
+    }
+    const bool nv12 = planes.format == framer::plane_format::NV12;
+    frame->format = nv12 ? AV_PIX_FMT_NV12 : AV_PIX_FMT_YUV420P;
+    frame->width = static_cast<int>(width_);
+    frame->height = static_cast<int>(height_);
+    for (int i = 0; i < (nv12 ? 2 : 3); i++) {
+      frame->data[i] = const_cast<uint8_t *>(planes.data[i]);
+      frame->linesize[i] = planes.linesize[i];
+    }
+    if (release) {
+      auto *opaque = new std::function<void()>(std::move(release));
+      frame->buf[0] = av_buffer_create(
+          frame->data[0],
+          static_cast<size_t>(planes.linesize[0]) * height_,
+          [](void *opaque, uint8_t *) {
+            auto *release = static_cast<std::function<void()> *>(opaque);
+            (*release)();
+            delete release;
+          },
+          opaque,
+          AV_BUFFER_FLAG_READONLY);
+      if (!frame->buf[0]) {
+        // fall back to letting libavcodec copy the planes
+        (*opaque)();
+        delete opaque;
+      }
+    }
+    return frame;
+  }
+
+  /**
+   * Prepares caller-owned planes for the encoder. When the layout matches the encoder's pixel format the planes are
+   * passed on as they are, otherwise they are converted into ost->frame.
+   */
+  AVFrame *get_video_frame(OutputStream *ost, AVFrame *planes) {
+    AVCodecContext *c = ost->enc;
+    if (planes->format == c->pix_fmt) {
+      AVFrame *frame = av_frame_clone(planes);
+      set_video_pts(ost, frame);
+      return frame;
+    }
+
+    planes_sws_ctx_ = sws_getCachedContext(planes_sws_ctx_,
+                                           c->width,
+                                           c->height,
+                                           (AVPixelFormat)planes->format,
+                                           c->width,
+                                           c->height,
+                                           c->pix_fmt,
+                                           SCALE_FLAGS,
+                                           nullptr,
+                                           nullptr,
+                                           nullptr);
+    if (!planes_sws_ctx_) {
+      fprintf(stderr, "Could not initialize the conversion context\n");
+      exit(1);
+    }
+    int ret = av_frame_make_writable(ost->frame);
+    if (ret < 0) exit(1);
+    sws_scale(planes_sws_ctx_,
+              (const uint8_t *const *)planes->data,
+              planes->linesize,
+              0,
+              c->height,
+              ost->frame->data,
+              ost->frame->linesize);
+    AVFrame *frame = av_frame_clone(ost->frame);
+    set_video_pts(ost, frame);
+    return frame;
   }
 
   /*
@@ -1107,88 +3372,454 @@ private:
    * return 1 when encoding is finished, 0 otherwise
    */
   int write_video_frame(AVFormatContext *oc, OutputStream *ost) {
-    int ret;
-    AVCodecContext *c;
-    AVFrame *frame;
-    int got_packet = 0;
-
-    c = ost->enc;
+    return write_video_frame(oc, ost, get_video_frame(ost));
+  }
 
-    frame = get_video_frame(ost);
+  int write_video_frame(AVFormatContext *oc, OutputStream *ost, AVFrame *frame) {
+    if (analysis_) _spool_frame(frame);
+    return encode_frame(oc, ost, frame);
+  }
 
-    AVPacket *pkt = av_packet_alloc();
-    if (!pkt) {
-      printf("av_packet_alloc failed\n");
-      return AVERROR(ENOMEM);
-    }
-    auto guard = sg::make_scope_guard([&] { av_packet_free(&pkt); });
+  /*
+   * send one frame to the encoder (nullptr flushes it) and mux every packet it has ready, encoders with lookahead,
+   * B-frames or frame threading return several at once, or none for a while
+   * return 1 when encoding is finished, 0 otherwise
+   */
+  int encode_frame(AVFormatContext *oc, OutputStream *ost, AVFrame *frame) {
+    AVCodecContext *c = ost->enc;
+    AVPacket *pkt = ost->tmp_pkt;
+    int got_packet = 0;
 
-    /* encode the image */
-    ret = avcodec_send_frame(c, frame);
-    if (ret < 0) {
-      return ret;
+    int ret = avcodec_send_frame(c, frame);
+    if (ret == AVERROR_EOF) {
+      return 1;  // already flushed
+    } else if (ret < 0) {
+      fprintf(stderr, "Error sending a frame to the encoder: %s\n", av_err2str(ret));
+      exit(1);
     }
 
-    ret = avcodec_receive_packet(c, pkt);
-
-    if (ret >= 0) {
+    while (true) {
+      ret = avcodec_receive_packet(c, pkt);
+      if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+        break;
+      } else if (ret < 0) {
+        fprintf(stderr, "Error encoding a frame: %s\n", av_err2str(ret));
+        exit(1);
+      }
       if (pkt->duration == 0) {
         if (c->codec_type == AVMEDIA_TYPE_AUDIO) {
-          pkt->duration = frame->nb_samples;
+          pkt->duration = frame ? frame->nb_samples : c->frame_size;
         } else if (c->codec_type == AVMEDIA_TYPE_VIDEO) {
           pkt->duration = av_rescale_q(1, c->time_base, ost->enc->time_base);
         }
       }
       got_packet = 1;
-    } else if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-      got_packet = 0;
-      ret = 0;
-    } else {
-      return ret;
-    }
-
-    if (ret < 0) {
-      fprintf(stderr, "Error encoding video frame: %s\n", av_err2str(ret));
-      exit(1);
-    }
+      _collect_stats(c);
 
-    if (got_packet) {
       ret = write_frame(oc, &c->time_base, ost->st, pkt);
-    } else {
-      ret = 0;
-    }
-
-    if (ret < 0) {
-      fprintf(stderr, "Error while writing video frame: %s\n", av_err2str(ret));
-      exit(1);
+      if (ret < 0) {
+        fprintf(stderr, "Error while writing output packet: %s\n", av_err2str(ret));
+        exit(1);
+      }
     }
 
+    // libvpx has no packets in the first pass, it only sets stats_out when flushed
+    _collect_stats(c);
     return (frame || got_packet) ? 0 : 1;
   }
 
+  // encoders write stats_out per packet (libavcodec's own) or once at the end (libvpx), so it's read after both
+  void _collect_stats(const AVCodecContext *c) {
+    if (!analysis_ || !c->stats_out || !c->stats_out[0] || last_stats_out_ == c->stats_out) return;
+    last_stats_out_ = c->stats_out;
+    stats_ += last_stats_out_;
+  }
+
   void close_stream(AVFormatContext *oc, OutputStream *ost) {
     av_channel_layout_uninit(&ost->frame->ch_layout);
+    av_freep(&ost->enc->stats_in);
     avcodec_free_context(&ost->enc);
     av_frame_free(&ost->frame);
     av_frame_free(&ost->tmp_frame);
     sws_freeContext(ost->sws_ctx);
     swr_free(&ost->swr_ctx);
+    av_packet_free(&ost->tmp_pkt);
   }
 
   /**************************************************************/
   /* media file output */
 };
 
-static void av_log_callback(void *ptr, int level, const char *fmt, va_list vl) {
-  if (!global_this) return;
+using frame_streamer = basic_frame_streamer<framer::dynamic_color_mode, framer::video_source, framer::audio_source>;
+
+/**
+ * Adaptive bitrate HLS: encodes one video source into a ladder of renditions, each with its own playlist, plus a master
+ * playlist that lists them. For "live.m3u8" the renditions go to "live_<width>x<height>.m3u8".
+ *
+ * Every frame is converted to YUV once, then scaled to each rung in parallel and handed to that rung's frame_streamer,
+ * which runs in async mode and so encodes and muxes on its own threads. All rungs stamp a frame with the same time and
+ * use the same fixed GOP, plus keyframes at the scene cuts set_scene_cut_detection() finds in the source, so their
+ * segments start on the same frames. Video only.
+ */
+class abr_streamer {
+public:
+  using color_mode = framer::color_mode;
+  using color_space = framer::color_space;
+  using color_range = framer::color_range;
+
+  abr_streamer(const std::string &filename,
+               int fps,
+               int width,
+               int height,
+               std::vector<framer::rendition> renditions,
+               color_mode cmode = color_mode::RGBA,
+               color_space cspace = color_space::AUTO,
+               color_range crange = color_range::LIMITED)
+      : fps_(fps), width_(width), height_(height), cmode_(cmode), renditions_(std::move(renditions)) {
+    // the source is converted once, so all rungs share its matrix
+    if (cspace == color_space::AUTO) {
+      cspace = height >= 720 ? color_space::BT709 : color_space::BT601;
+    }
+    rgba_coefficients_ = framer::coefficients_for(cspace, crange, color_mode::RGBA);
+    bgra_coefficients_ = framer::coefficients_for(cspace, crange, color_mode::BGRA);
+
+    const size_t ext = filename.rfind(".m3u8");
+    const std::string stem = ext == std::string::npos ? filename : filename.substr(0, ext);
+    const size_t slash = stem.rfind('/');
+    const std::string base = slash == std::string::npos ? stem : stem.substr(slash + 1);
+
+    const auto start_time = std::chrono::steady_clock::now();
+    std::vector<std::string> playlists;
+    for (const framer::rendition &r : renditions_) {
+      const std::string suffix = "_" + std::to_string(r.width) + "x" + std::to_string(r.height) + ".m3u8";
+      playlists.push_back(base + suffix);
+      auto rung = std::make_unique<frame_streamer>(
+          stem + suffix, r.bitrate, fps, r.width, r.height, frame_streamer::stream_mode::HLS, cmode, cspace, crange);
+      rung->start_time_ = start_time;
+      rung->set_async(4);
+      rungs_.push_back(std::move(rung));
+
+      SwsContext *scaler = nullptr;
+      AVFrame *scaled = nullptr;
+      if (r.width != width || r.height != height) {
+        scaler = sws_getContext(width,
+                                height,
+                                AV_PIX_FMT_YUV420P,
+                                r.width,
+                                r.height,
+                                AV_PIX_FMT_YUV420P,
+                                SCALE_FLAGS,
+                                nullptr,
+                                nullptr,
+                                nullptr);
+        scaled = _alloc_frame(r.width, r.height);
+        if (!scaler) {
+          fprintf(stderr, "Could not initialize the conversion context\n");
+          exit(1);
+        }
+      }
+      scalers_.push_back(scaler);
+      scaled_.push_back(scaled);
+    }
+    source_ = _alloc_frame(width, height);
+    set_encoder_options({});
 
-  char buf[512] = {0x00};
-  vsnprintf(buf, 512, fmt, vl);
-  buf[512 - 1] = 0x00;
-  global_this->log_callback_level = level;
-  global_this->log_callback_buffer.append(buf);
-  if (global_this->log_callback_buffer[global_this->log_callback_buffer.size() - 1] == '\n') {
-    global_this->log_callback(global_this->log_callback_level, global_this->log_callback_buffer);
-    global_this->log_callback_buffer = "";
+    pool_.resize(static_cast<int>(std::max(std::thread::hardware_concurrency(), 1u)));
+    _write_master_playlist(filename, playlists);
   }
-}
+
+  abr_streamer(const abr_streamer &) = delete;
+  abr_streamer &operator=(const abr_streamer &) = delete;
+
+  ~abr_streamer() {
+    finalize();
+    for (SwsContext *scaler : scalers_) sws_freeContext(scaler);
+    for (AVFrame *&frame : scaled_) av_frame_free(&frame);
+    av_frame_free(&source_);
+  }
+
+  /**
+   * Applied to every rung, with the bitrate of each rendition. The GOP defaults to one second, and the encoders' own
+   * scene-cut keyframes are switched off to keep the rungs aligned. Must be called before the first frame.
+   */
+  void set_encoder_options(framer::encoder_options options) {
+    if (options.gop_size < 0) options.gop_size = fps_;
+    options.private_options.emplace_back("sc_threshold", "0");
+    for (auto &rung : rungs_) rung->set_encoder_options(options);
+  }
+
+  /**
+   * Forces keyframes at scene cuts on all rungs at once, see frame_streamer::set_scene_cut_detection(). Detection runs
+   * on the source, so the rungs stay aligned.
+   */
+  void set_scene_cut_detection(double threshold = 0.3, int min_gap = -1) {
+    scene_detector_.threshold = threshold;
+    scene_detector_.min_gap = min_gap;
+  }
+
+  void add_frame(std::vector<uint32_t> &pixels, bool force_keyframe = false) {
+    add_frame(framer::image_view(pixels.data(), width_, height_), force_keyframe);
+  }
+
+  void add_frame(const framer::image_view &image, bool force_keyframe = false) {
+    if (image.width != width_ || image.height != height_) {
+      throw std::runtime_error("image dimensions do not match the stream");
+    }
+    const auto time = std::chrono::steady_clock::now();
+    const color_mode layout = image.layout ? *image.layout : cmode_;
+    const yuv::coefficients &k = layout == color_mode::RGBA ? rgba_coefficients_ : bgra_coefficients_;
+    framer::convert_to_yuv420p(image, k, source_->data, source_->linesize, pool_);
+    if (scene_detector_.threshold > 0 &&
+        scene_detector_.cut(source_->data[0], source_->linesize[0], width_, height_, fps_)) {
+      force_keyframe = true;
+    }
+
+    // the rungs copy the planes they're given, so the buffers are free again once this returns
+    pool_.parallel_for(static_cast<int>(rungs_.size()), [&](int i) {
+      AVFrame *frame = source_;
+      if (scalers_[i]) {
+        frame = scaled_[i];
+        sws_scale(scalers_[i],
+                  (const uint8_t *const *)source_->data,
+                  source_->linesize,
+                  0,
+                  height_,
+                  frame->data,
+                  frame->linesize);
+      }
+      framer::yuv_planes planes;
+      for (int p = 0; p < 3; p++) {
+        planes.data[p] = frame->data[p];
+        planes.linesize[p] = frame->linesize[p];
+      }
+      rungs_[i]->_add_planes(planes, nullptr, time, force_keyframe);
+    });
+  }
+
+  void finalize() {
+    pool_.parallel_for(static_cast<int>(rungs_.size()), [&](int i) { rungs_[i]->finalize(); });
+  }
+
+private:
+  int fps_;
+  int width_;
+  int height_;
+  color_mode cmode_;
+  yuv::coefficients rgba_coefficients_;
+  yuv::coefficients bgra_coefficients_;
+  std::vector<framer::rendition> renditions_;
+  std::vector<std::unique_ptr<frame_streamer>> rungs_;
+  std::vector<SwsContext *> scalers_;  // nullptr for rungs at the source size
+  std::vector<AVFrame *> scaled_;
+  AVFrame *source_ = nullptr;
+  framer::scene_detector scene_detector_;
+  worker_pool pool_;
+
+  static AVFrame *_alloc_frame(int width, int height) {
+    AVFrame *frame = av_frame_alloc();
+    if (!frame) {
+      fprintf(stderr, "Could not allocate video frame\n");
+      exit(1);
+    }
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width = width;
+    frame->height = height;
+    if (av_frame_get_buffer(frame, 0) < 0) {
+      fprintf(stderr, "Could not allocate frame data.\n");
+      exit(1);
+    }
+    return frame;
+  }
+
+  void _write_master_playlist(const std::string &filename, const std::vector<std::string> &playlists) {
+    FILE *f = fopen(filename.c_str(), "w");
+    if (!f) {
+      throw std::runtime_error("Could not open master playlist " + filename);
+    }
+    fprintf(f, "#EXTM3U\n#EXT-X-VERSION:3\n");
+    for (size_t i = 0; i < renditions_.size(); i++) {
+      fprintf(f,
+              "#EXT-X-STREAM-INF:BANDWIDTH=%zu,RESOLUTION=%dx%d\n%s\n",
+              renditions_[i].bitrate,
+              renditions_[i].width,
+              renditions_[i].height,
+              playlists[i].c_str());
+    }
+    fclose(f);
+  }
+};
+
+/**
+ * Offline rendering of a video file on many cores. The timeline is split into chunks that are encoded concurrently by
+ * independent frame_streamers, each chunk starts with a keyframe and is a closed group of pictures. The chunks are
+ * then stream-copied into the output file, with their timestamps shifted to where each chunk starts. Video only.
+ *
+ * Every chunk in flight has its own encoder with its own lookahead, so memory grows with the number of parallel chunks.
+ */
+class chunked_encoder {
+public:
+  using color_mode = framer::color_mode;
+  using color_space = framer::color_space;
+  using color_range = framer::color_range;
+
+  chunked_encoder(std::string filename,
+                  size_t bitrate,
+                  int fps,
+                  int width,
+                  int height,
+                  color_mode cmode = color_mode::RGBA,
+                  color_space cspace = color_space::AUTO,
+                  color_range crange = color_range::LIMITED)
+      : filename_(std::move(filename)),
+        bitrate_(bitrate),
+        fps_(fps),
+        width_(width),
+        height_(height),
+        cmode_(cmode),
+        cspace_(cspace),
+        crange_(crange),
+        chunk_frames_(fps * 10) {
+    const int cores = static_cast<int>(std::max(std::thread::hardware_concurrency(), 1u));
+    parallel_chunks_ = std::max(1, cores / 4);
+  }
+
+  void set_encoder_options(framer::encoder_options options) { options_ = std::move(options); }
+
+  /**
+   * Frames per chunk, 10 seconds by default. Shorter chunks balance better across threads, but every chunk starts with
+   * a keyframe and restarts the encoder's rate control.
+   */
+  void set_chunk_frames(int frames) { chunk_frames_ = std::max(frames, 1); }
+
+  /**
+   * Number of chunks encoded at the same time, a quarter of the cores by default. The cores are split evenly between
+   * the chunks' encoders.
+   */
+  void set_parallel_chunks(int chunks) { parallel_chunks_ = std::max(chunks, 1); }
+
+  /**
+   * Renders frames 0 to num_frames - 1 and writes them to the output file. An empty timeline is an error, there would
+   * be no stream to write.
+   */
+  void encode(int64_t num_frames, const framer::indexed_video_source &source) {
+    if (num_frames <= 0) {
+      fprintf(stderr, "No frames to encode into %s\n", filename_.c_str());
+      exit(1);
+    }
+    const int64_t num_chunks = (num_frames + chunk_frames_ - 1) / chunk_frames_;
+    std::vector<std::string> chunks;
+    for (int64_t k = 0; k < num_chunks; k++) {
+      chunks.push_back(filename_ + ".chunk" + std::to_string(k) + ".mp4");
+    }
+
+    const int cores = static_cast<int>(std::max(std::thread::hardware_concurrency(), 1u));
+    const int workers = static_cast<int>(std::min<int64_t>(parallel_chunks_, num_chunks));
+    const int threads_per_chunk = std::max(1, cores / std::max(workers, 1));
+    std::atomic<int64_t> next_chunk{0};
+    auto encode_chunks = [&] {
+      std::vector<unsigned int> pixels(width_ * height_);
+      for (int64_t k = next_chunk++; k < num_chunks; k = next_chunk++) {
+        frame_streamer fs(
+            chunks[k], bitrate_, fps_, width_, height_, frame_streamer::stream_mode::FILE, cmode_, cspace_, crange_);
+        fs.set_encoder_options(options_);
+        fs.set_num_threads(threads_per_chunk);
+        const int64_t last = std::min(num_frames, (k + 1) * chunk_frames_);
+        for (int64_t i = k * chunk_frames_; i < last; i++) {
+          std::fill(pixels.begin(), pixels.end(), 0x00000000);
+          source(i, pixels, width_, height_);
+          fs.add_frame(pixels);
+        }
+        fs.finalize();
+      }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < workers; i++) threads.emplace_back(encode_chunks);
+    encode_chunks();
+    for (auto &t : threads) t.join();
+
+    _concat(chunks);
+  }
+
+private:
+  std::string filename_;
+  size_t bitrate_;
+  int fps_;
+  int width_;
+  int height_;
+  color_mode cmode_;
+  color_space cspace_;
+  color_range crange_;
+  int64_t chunk_frames_;
+  int parallel_chunks_;
+  framer::encoder_options options_;
+
+  void _concat(const std::vector<std::string> &chunks) {
+    AVFormatContext *out = nullptr;
+    avformat_alloc_output_context2(&out, nullptr, nullptr, filename_.c_str());
+    if (!out) {
+      fprintf(stderr, "Could not deduce output format for %s\n", filename_.c_str());
+      exit(1);
+    }
+    AVPacket *pkt = av_packet_alloc();
+    auto guard = sg::make_scope_guard([&] {
+      av_packet_free(&pkt);
+      if (out->pb) avio_closep(&out->pb);
+      avformat_free_context(out);
+    });
+
+    AVStream *out_st = nullptr;
+    for (size_t k = 0; k < chunks.size(); k++) {
+      AVFormatContext *in = nullptr;
+      if (avformat_open_input(&in, chunks[k].c_str(), nullptr, nullptr) < 0) {
+        fprintf(stderr, "Could not open chunk %s\n", chunks[k].c_str());
+        exit(1);
+      }
+      if (avformat_find_stream_info(in, nullptr) < 0 || in->nb_streams != 1) {
+        fprintf(stderr, "Unexpected streams in chunk %s\n", chunks[k].c_str());
+        exit(1);
+      }
+      AVStream *in_st = in->streams[0];
+
+      if (!out_st) {
+        // every chunk's encoder ran with the same settings, so the first chunk's headers are valid for all of them
+        out_st = avformat_new_stream(out, nullptr);
+        if (!out_st || avcodec_parameters_copy(out_st->codecpar, in_st->codecpar) < 0) {
+          fprintf(stderr, "Could not add the output stream\n");
+          exit(1);
+        }
+        out_st->codecpar->codec_tag = 0;
+        out_st->time_base = in_st->time_base;
+        if (!(out->oformat->flags & AVFMT_NOFILE) && avio_open(&out->pb, filename_.c_str(), AVIO_FLAG_WRITE) < 0) {
+          fprintf(stderr, "Could not open %s\n", filename_.c_str());
+          exit(1);
+        }
+        if (avformat_write_header(out, nullptr) < 0) {
+          fprintf(stderr, "Could not write the header of %s\n", filename_.c_str());
+          exit(1);
+        }
+      }
+
+      // each chunk's timestamps start at zero, with B-frames its dts start just below
+      const int64_t offset = av_rescale_q(int64_t(k) * chunk_frames_, AVRational{1, fps_}, in_st->time_base);
+      while (av_read_frame(in, pkt) >= 0) {
+        if (pkt->pts != AV_NOPTS_VALUE) pkt->pts += offset;
+        if (pkt->dts != AV_NOPTS_VALUE) pkt->dts += offset;
+        av_packet_rescale_ts(pkt, in_st->time_base, out_st->time_base);
+        pkt->stream_index = out_st->index;
+        pkt->pos = -1;
+        int ret = av_interleaved_write_frame(out, pkt);
+        if (ret < 0) {
+          fprintf(stderr, "Error while writing output packet: %s\n", av_err2str(ret));
+          exit(1);
+        }
+      }
+      avformat_close_input(&in);
+      std::remove(chunks[k].c_str());
+    }
+    if (!out_st) {
+      fprintf(stderr, "No chunks were encoded into %s\n", filename_.c_str());
+      exit(1);
+    }
+    av_write_trailer(out);
+  }
+};
@@ -29,7 +29,7 @@ pushd $test_dir
   ls -alh
 
   md5_observed=$(ls -1 | sort | md5sum -)
-  md5_expected="983feb3f676764439e2663918a957c15  -"
+  md5_expected="cf30500093a97b7306f3a78154babf99  -"
 
   if [[ $md5_observed != $md5_expected ]]; then
       echo ERROR: Something in the output changed.